@@ -0,0 +1,199 @@
+#include "checkpoint.h"
+#include "sm3.h"
+#include "read_pipeline.h"
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+/*
+ * A checkpoint of FILE lives in FILE.sm3ckpt and holds the whole streaming context
+ * after some prefix of the file, so hashing can go on from the end of that prefix.
+ * Reaching the end of the file removes the checkpoint: it is only left behind by a
+ * run that was interrupted or failed to read the file.
+ *
+ * A checkpoint is only trusted for the same inode, a file at least as long as the
+ * prefix, and an unchanged last CHECKPOINT_GUARD bytes of the prefix (their SM3 is
+ * kept in the checkpoint). A file of the same size must also have the same mtime,
+ * a file that has grown is taken to be append-only: a change further back than the
+ * guard in a file that also grew goes unnoticed.
+ */
+
+#define CHECKPOINT_MAGIC "SM3CKPT"
+#define CHECKPOINT_BOM 0x01020304u
+#define CHECKPOINT_GUARD 4096
+
+extern sm3_arguments sm3_args;
+
+typedef struct {
+    char magic[8];
+    uint32_t bom;
+    uint32_t buf_len;
+    uint64_t dev;
+    uint64_t ino;
+    uint64_t total_len; // length of the prefix, also where reading resumes
+    uint64_t file_size; // size and mtime of the file when the checkpoint was taken
+    int64_t mtime_ns;
+    uint32_t V[8];
+    uint8_t buf[SM3_BLOCK_BYTES];
+    uint8_t guard[SM3_DIGEST_SIZE];
+} checkpoint_record;
+
+/*
+ * function: SM3 of the CHECKPOINT_GUARD bytes (or fewer) that end at offset end
+ * return: 0 on success, -1 if they cannot be read
+ */
+static int guard_digest(int fd, uint64_t end, uint8_t *digest) {
+    uint8_t buf[CHECKPOINT_GUARD];
+    size_t len = end < CHECKPOINT_GUARD ? end : CHECKPOINT_GUARD;
+    size_t got = 0;
+    while (got < len) {
+        ssize_t n = pread(fd, buf + got, len - got, end - len + got);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return -1;
+        }
+        got += n;
+    }
+    sm3(buf, len, digest);
+    return 0;
+}
+
+/*
+ * function: write ctx to the sidecar, through a temporary file so that a crash leaves
+ * either the old or the new checkpoint; the sidecar is private to the owner, since the
+ * buffered bytes of the context are plain text of the file
+ * return: 0 on success, -1 on failure
+ */
+static int checkpoint_save(const char *path, int fd, const struct stat *st, const sm3_ctx *ctx) {
+    checkpoint_record rec;
+    memset(&rec, 0, sizeof(rec));
+    memcpy(rec.magic, CHECKPOINT_MAGIC, sizeof(rec.magic));
+    rec.bom = CHECKPOINT_BOM;
+    rec.buf_len = ctx->buf_len;
+    rec.dev = st->st_dev;
+    rec.ino = st->st_ino;
+    rec.total_len = ctx->total_len;
+    rec.file_size = st->st_size;
+    rec.mtime_ns = (int64_t)st->st_mtim.tv_sec * 1000000000LL + st->st_mtim.tv_nsec;
+    memcpy(rec.V, ctx->V, sizeof(rec.V));
+    memcpy(rec.buf, ctx->buf, ctx->buf_len);
+    if (guard_digest(fd, rec.total_len, rec.guard) != 0) {
+        return -1;
+    }
+
+    // mkstemp creates the file 0600 under a name of its own, concurrent runs do not collide
+    size_t len = strlen(path) + 8;
+    char *tmp = (char *)malloc(len);
+    snprintf(tmp, len, "%s.XXXXXX", path);
+    int out = mkstemp(tmp);
+    int ret = -1;
+    if (out >= 0) {
+        ret = write(out, &rec, sizeof(rec)) == sizeof(rec) ? 0 : -1;
+        if (close(out) != 0 || ret != 0 || rename(tmp, path) != 0) {
+            unlink(tmp);
+            ret = -1;
+        }
+    }
+    free(tmp);
+    return ret;
+}
+
+/*
+ * function: restore ctx from the sidecar if it belongs to this version of the file
+ * return: true if ctx was restored, false if hashing starts from the beginning
+ */
+static bool checkpoint_load(const char *path, int fd, const struct stat *st, sm3_ctx *ctx) {
+    checkpoint_record rec;
+    uint8_t guard[SM3_DIGEST_SIZE];
+    int in = open(path, O_RDONLY | O_CLOEXEC);
+    if (in < 0) {
+        return false;
+    }
+    bool ok = read(in, &rec, sizeof(rec)) == sizeof(rec);
+    close(in);
+    if (!ok || memcmp(rec.magic, CHECKPOINT_MAGIC, sizeof(rec.magic)) != 0 || rec.bom != CHECKPOINT_BOM ||
+        rec.buf_len >= SM3_BLOCK_BYTES || rec.total_len % SM3_BLOCK_BYTES != rec.buf_len ||
+        rec.dev != (uint64_t)st->st_dev || rec.ino != (uint64_t)st->st_ino ||
+        rec.total_len > (uint64_t)st->st_size ||
+        (rec.file_size == (uint64_t)st->st_size &&
+         rec.mtime_ns != (int64_t)st->st_mtim.tv_sec * 1000000000LL + st->st_mtim.tv_nsec) ||
+        guard_digest(fd, rec.total_len, guard) != 0 || memcmp(guard, rec.guard, SM3_DIGEST_SIZE) != 0) {
+        return false;
+    }
+    memcpy(ctx->V, rec.V, sizeof(ctx->V));
+    memcpy(ctx->buf, rec.buf, rec.buf_len);
+    ctx->buf_len = rec.buf_len;
+    ctx->total_len = rec.total_len;
+    return true;
+}
+
+/*
+ * file_name: name of the file, FILE_NAME.sm3ckpt is its checkpoint
+ * fd: the file opened for reading, its offset is left anywhere
+ * interval: bytes hashed between two checkpoints
+ * digest: at least SM3_DIGEST_SIZE bytes, receives the hash value
+ * stats: receives the bytes hashed in this run and read and hash times for --stats, may be NULL
+ * function: hash a regular file from its last checkpoint, leaving checkpoints behind on the way
+ * and removing them once the file is hashed; a sidecar that cannot be written only costs the
+ * ability to resume
+ * return: 0 on success, -1 on a read error
+ */
+int checkpoint_hash(const char *file_name, int fd, size_t interval, uint8_t *digest, sm3_io_stats *stats) {
+    struct stat st;
+    sm3_ctx ctx;
+    size_t len = strlen(file_name) + sizeof(CHECKPOINT_SUFFIX);
+    char *path = (char *)malloc(len);
+    snprintf(path, len, "%s" CHECKPOINT_SUFFIX, file_name);
+    if (fstat(fd, &st) != 0 || !checkpoint_load(path, fd, &st, &ctx)) {
+        sm3_init(&ctx);
+    }
+    uint64_t saved = ctx.total_len, resumed = ctx.total_len;
+    if (lseek(fd, ctx.total_len, SEEK_SET) < 0) {
+        free(path);
+        return -1;
+    }
+
+    read_pipeline *pipe = pipeline_open(fd, sm3_args.io_mode != IO_THREAD);
+    const uint8_t *data = NULL;
+    size_t got;
+    if (pipe != NULL) {
+        uint64_t now = stats != NULL ? stats_clock() : 0;
+        while ((data = pipeline_next(pipe, &got)) != NULL && got > 0) {
+            if (stats != NULL) {
+                stats->read_ns += stats_clock() - now;
+                now = stats_clock();
+            }
+            sm3_update(&ctx, data, got);
+            if (stats != NULL) {
+                stats->hash_ns += stats_clock() - now;
+                now = stats_clock();
+            }
+            if (ctx.total_len - saved >= interval) {
+                checkpoint_save(path, fd, &st, &ctx);
+                saved = ctx.total_len;
+            }
+        }
+        pipeline_close(pipe);
+    }
+    if (data == NULL) {
+        // keep the last good checkpoint
+        free(path);
+        return -1;
+    }
+    unlink(path);
+    if (stats != NULL) {
+        stats->bytes = ctx.total_len - resumed;
+    }
+    sm3_final(&ctx, digest);
+    free(path);
+    return 0;
+}
@@ -0,0 +1,15 @@
+#ifndef CHECKPOINT_H
+#define CHECKPOINT_H
+#include <stddef.h>
+#include <stdint.h>
+#include "stats.h"
+/*
+ * This header contains declearations of resumable hashing, which saves the
+ * midstate of a file next to it and continues from there on the next run
+ */
+#define CHECKPOINT_SUFFIX ".sm3ckpt"
+#define CHECKPOINT_INTERVAL ((size_t)256 << 20) // default bytes hashed between two checkpoints
+
+int checkpoint_hash(const char *file_name, int fd, size_t interval, uint8_t *digest, sm3_io_stats *stats);
+
+#endif // CHECKPOINT_H
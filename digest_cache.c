@@ -0,0 +1,372 @@
+#include "digest_cache.h"
+#include "sm3.h"
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+
+/*
+ * The cache file is a header followed by fixed size records in native byte order.
+ * A record is keyed by (dev, ino, tree_chunk) and is valid while size, mtime and ctime
+ * are still the same; a record later in the file replaces an earlier one with the same key.
+ *
+ * Writers hold an exclusive flock() and only append whole records, so sm3sum processes
+ * running at the same time never see each other's half written data. Once more than half
+ * of the records have been replaced, the live ones are written to a new file that is
+ * renamed over the old one; a writer that finds the path pointing to another inode after
+ * taking the lock starts over with the new file.
+ */
+
+#define CACHE_MAGIC "SM3CACHE"
+#define CACHE_BOM 0x01020304u // tells a cache written on another byte order
+#define CACHE_SETTLE_NS 2000000000LL // files changed this recently are hashed but not cached
+#define CACHE_MIN_COMPACT 4096 // never rewrite files with fewer records than this
+
+typedef struct {
+    char magic[8];
+    uint32_t bom;
+    uint32_t record_size;
+} cache_header;
+
+typedef struct {
+    uint64_t dev;
+    uint64_t ino;
+    uint64_t tree_chunk;
+    uint64_t size;
+    int64_t mtime_ns;
+    int64_t ctime_ns;
+    uint8_t digest[SM3_DIGEST_SIZE];
+} cache_record;
+
+struct digest_cache {
+    char *path;
+    cache_record *records;
+    size_t count, cap;
+    size_t loaded; // records[0, loaded) were read from the file, the rest are to be written
+    uint32_t *index; // open addressing, record number + 1, 0 for an empty slot
+    size_t index_size; // a power of 2
+    size_t live; // number of distinct keys
+};
+
+static int64_t timespec_ns(const struct timespec *ts) {
+    return (int64_t)ts->tv_sec * 1000000000LL + ts->tv_nsec;
+}
+
+static void record_fill(cache_record *rec, const struct stat *st, size_t tree_chunk) {
+    memset(rec, 0, sizeof(*rec));
+    rec->dev = st->st_dev;
+    rec->ino = st->st_ino;
+    rec->tree_chunk = tree_chunk;
+    rec->size = st->st_size;
+    rec->mtime_ns = timespec_ns(&st->st_mtim);
+    rec->ctime_ns = timespec_ns(&st->st_ctim);
+}
+
+static bool same_key(const cache_record *a, const cache_record *b) {
+    return a->dev == b->dev && a->ino == b->ino && a->tree_chunk == b->tree_chunk;
+}
+
+static bool same_version(const cache_record *a, const cache_record *b) {
+    return a->size == b->size && a->mtime_ns == b->mtime_ns && a->ctime_ns == b->ctime_ns;
+}
+
+static size_t key_hash(const cache_record *rec) {
+    uint64_t h = rec->ino * 0x9e3779b97f4a7c15ULL ^ rec->dev * 0xc2b2ae3d27d4eb4fULL ^ rec->tree_chunk;
+    return (size_t)(h ^ h >> 29);
+}
+
+/*
+ * return: the index slot holding rec's key, or the empty slot where it would go
+ */
+static uint32_t *index_slot(digest_cache *cache, const cache_record *rec) {
+    size_t mask = cache->index_size - 1;
+    for (size_t i = key_hash(rec) & mask; ; i = (i + 1) & mask) {
+        uint32_t *slot = &cache->index[i];
+        if (*slot == 0 || same_key(&cache->records[*slot - 1], rec)) {
+            return slot;
+        }
+    }
+}
+
+/*
+ * function: keep the index at most half full
+ * return: 0 on success, -1 if out of memory
+ */
+static int index_reserve(digest_cache *cache) {
+    if ((cache->live + 1) * 2 <= cache->index_size) {
+        return 0;
+    }
+    size_t old_size = cache->index_size;
+    uint32_t *old = cache->index;
+    cache->index_size = old_size ? old_size * 2 : 1024;
+    cache->index = (uint32_t *)calloc(cache->index_size, sizeof(uint32_t));
+    if (cache->index == NULL) {
+        cache->index = old;
+        cache->index_size = old_size;
+        return -1;
+    }
+    for (size_t i = 0; i < old_size; i++) {
+        if (old[i] != 0) {
+            *index_slot(cache, &cache->records[old[i] - 1]) = old[i];
+        }
+    }
+    free(old);
+    return 0;
+}
+
+/*
+ * function: add a record, replacing the one with the same key
+ * return: 0 on success, -1 if out of memory
+ */
+static int cache_add(digest_cache *cache, const cache_record *rec) {
+    if (cache->count >= UINT32_MAX - 1) {
+        return -1;
+    }
+    if (cache->count == cache->cap) {
+        size_t cap = cache->cap ? cache->cap * 2 : 1024;
+        cache_record *records = (cache_record *)realloc(cache->records, cap * sizeof(cache_record));
+        if (records == NULL) {
+            return -1;
+        }
+        cache->records = records;
+        cache->cap = cap;
+    }
+    if (index_reserve(cache) != 0) {
+        return -1;
+    }
+    cache->records[cache->count++] = *rec;
+    uint32_t *slot = index_slot(cache, rec);
+    if (*slot == 0) {
+        ++cache->live;
+    }
+    *slot = (uint32_t)cache->count;
+    return 0;
+}
+
+/*
+ * fd: an open cache file
+ * return: true if the file holds a header this build understands (or nothing at all),
+ * a torn record at the end left by a crash is ignored
+ */
+static bool cache_load(digest_cache *cache, int fd) {
+    struct stat st;
+    cache_header header;
+    if (fstat(fd, &st) != 0) {
+        return false;
+    }
+    if (st.st_size == 0) {
+        return true;
+    }
+    if (pread(fd, &header, sizeof(header), 0) != sizeof(header) ||
+        memcmp(header.magic, CACHE_MAGIC, sizeof(header.magic)) != 0 ||
+        header.bom != CACHE_BOM || header.record_size != sizeof(cache_record)) {
+        return false;
+    }
+    cache_record batch[256];
+    off_t offset = sizeof(header);
+    ssize_t got;
+    while ((got = pread(fd, batch, sizeof(batch), offset)) > 0) {
+        size_t n = got / sizeof(cache_record);
+        for (size_t i = 0; i < n; i++) {
+            if (cache_add(cache, &batch[i]) != 0) {
+                return false;
+            }
+        }
+        if (n == 0) {
+            break;
+        }
+        offset += n * sizeof(cache_record);
+    }
+    return got >= 0;
+}
+
+/*
+ * path: the cache file, created on the first cache_close() with something to store
+ * return: the cache, NULL if out of memory, an unreadable file gives an empty cache
+ */
+digest_cache *cache_open(const char *path) {
+    digest_cache *cache = (digest_cache *)calloc(1, sizeof(digest_cache));
+    if (cache == NULL || (cache->path = strdup(path)) == NULL) {
+        free(cache);
+        return NULL;
+    }
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd >= 0) {
+        flock(fd, LOCK_SH);
+        if (!cache_load(cache, fd)) {
+            // nothing usable, hash everything; cache_close() will not touch the file either
+            cache->count = cache->live = 0;
+            if (cache->index != NULL) {
+                memset(cache->index, 0, cache->index_size * sizeof(uint32_t));
+            }
+        }
+        close(fd);
+    }
+    cache->loaded = cache->count;
+    return cache;
+}
+
+/*
+ * st: status of the file, taken before it would be hashed
+ * tree_chunk: 0 for plain SM3, chunk size of an SM3TREE digest otherwise
+ * digest: at least SM3_DIGEST_SIZE bytes, receives the cached digest
+ * return: true if the cache has a digest for this version of the file
+ */
+bool cache_lookup(digest_cache *cache, const struct stat *st, size_t tree_chunk, uint8_t *digest) {
+    cache_record key;
+    record_fill(&key, st, tree_chunk);
+    if (cache->index_size == 0) {
+        return false;
+    }
+    uint32_t slot = *index_slot(cache, &key);
+    if (slot == 0 || !same_version(&cache->records[slot - 1], &key)) {
+        return false;
+    }
+    memcpy(digest, cache->records[slot - 1].digest, SM3_DIGEST_SIZE);
+    return true;
+}
+
+/*
+ * before, after: status of the file before and after it was hashed
+ * function: remember the digest, unless the file changed while it was read or so recently
+ * that another change could still leave the same timestamps behind
+ */
+void cache_store(digest_cache *cache, const struct stat *before, const struct stat *after,
+                 size_t tree_chunk, const uint8_t *digest) {
+    cache_record rec, check;
+    struct timespec now;
+    record_fill(&rec, before, tree_chunk);
+    record_fill(&check, after, tree_chunk);
+    clock_gettime(CLOCK_REALTIME, &now);
+    if (!same_key(&rec, &check) || !same_version(&rec, &check) ||
+        rec.mtime_ns > timespec_ns(&now) - CACHE_SETTLE_NS ||
+        rec.ctime_ns > timespec_ns(&now) - CACHE_SETTLE_NS) {
+        return;
+    }
+    memcpy(rec.digest, digest, SM3_DIGEST_SIZE);
+    cache_add(cache, &rec);
+}
+
+static int write_all(int fd, const void *buf, size_t len, off_t offset) {
+    const char *p = (const char *)buf;
+    while (len > 0) {
+        ssize_t put = pwrite(fd, p, len, offset);
+        if (put < 0 && errno == EINTR) {
+            continue;
+        }
+        if (put <= 0) {
+            return -1;
+        }
+        p += put;
+        len -= put;
+        offset += put;
+    }
+    return 0;
+}
+
+/*
+ * function: write the live records of cache to a new file and rename it over path
+ */
+static int cache_rewrite(digest_cache *cache) {
+    size_t len = strlen(cache->path) + 32;
+    char *tmp = (char *)malloc(len);
+    cache_header header;
+    int ret = 0;
+    snprintf(tmp, len, "%s.%ld.tmp", cache->path, (long)getpid());
+    int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    if (fd < 0) {
+        free(tmp);
+        return -1;
+    }
+    memcpy(header.magic, CACHE_MAGIC, sizeof(header.magic));
+    header.bom = CACHE_BOM;
+    header.record_size = sizeof(cache_record);
+    ret = write_all(fd, &header, sizeof(header), 0);
+    off_t offset = sizeof(header);
+    for (size_t i = 0; i < cache->index_size && ret == 0; i++) {
+        if (cache->index[i] != 0) {
+            ret = write_all(fd, &cache->records[cache->index[i] - 1], sizeof(cache_record), offset);
+            offset += sizeof(cache_record);
+        }
+    }
+    if (close(fd) != 0 || ret != 0 || rename(tmp, cache->path) != 0) {
+        unlink(tmp);
+        ret = -1;
+    }
+    free(tmp);
+    return ret;
+}
+
+/*
+ * function: merge the stored digests into the cache file and free the cache
+ * return: 0 on success, -1 if the cache file could not be written
+ */
+int cache_close(digest_cache *cache) {
+    int ret = 0;
+    while (cache->count > cache->loaded) {
+        int fd = open(cache->path, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+        struct stat held, named;
+        if (fd < 0 || flock(fd, LOCK_EX) != 0) {
+            ret = -1;
+            if (fd >= 0) {
+                close(fd);
+            }
+            break;
+        }
+        if (fstat(fd, &held) != 0 || stat(cache->path, &named) != 0 ||
+            held.st_ino != named.st_ino || held.st_dev != named.st_dev) {
+            // replaced by a compaction while we waited for the lock
+            close(fd);
+            continue;
+        }
+        // records other processes appended since cache_open() come first, ours win
+        digest_cache *disk = (digest_cache *)calloc(1, sizeof(digest_cache));
+        if (disk == NULL) {
+            close(fd);
+            ret = -1;
+            break;
+        }
+        bool valid = cache_load(disk, fd);
+        size_t on_disk = disk->count;
+        for (size_t i = cache->loaded; i < cache->count; i++) {
+            cache_add(disk, &cache->records[i]);
+        }
+        if (!valid) {
+            // not written by sm3sum, or by a build with another record layout, leave it alone
+            ret = -1;
+        } else if (disk->count >= CACHE_MIN_COMPACT && disk->count > 2 * disk->live) {
+            disk->path = cache->path;
+            ret = cache_rewrite(disk);
+        } else {
+            cache_header header;
+            memcpy(header.magic, CACHE_MAGIC, sizeof(header.magic));
+            header.bom = CACHE_BOM;
+            header.record_size = sizeof(cache_record);
+            // overwrites a torn record at the end, if any
+            off_t offset = sizeof(header) + on_disk * sizeof(cache_record);
+            ret = on_disk == 0 ? write_all(fd, &header, sizeof(header), 0) : 0;
+            if (ret == 0) {
+                ret = write_all(fd, cache->records + cache->loaded,
+                                (cache->count - cache->loaded) * sizeof(cache_record), offset);
+            }
+        }
+        free(disk->records);
+        free(disk->index);
+        free(disk);
+        close(fd);
+        break;
+    }
+    free(cache->records);
+    free(cache->index);
+    free(cache->path);
+    free(cache);
+    return ret;
+}
@@ -0,0 +1,21 @@
+#ifndef DIGEST_CACHE_H
+#define DIGEST_CACHE_H
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <sys/stat.h>
+/*
+ * This header contains declearations of the digest cache, which remembers
+ * the digest of a file as long as its inode, size and timestamps stay the same
+ */
+#define CACHE_ENV "SM3SUM_CACHE"
+
+typedef struct digest_cache digest_cache;
+
+digest_cache *cache_open(const char *path);
+bool cache_lookup(digest_cache *cache, const struct stat *st, size_t tree_chunk, uint8_t *digest);
+void cache_store(digest_cache *cache, const struct stat *before, const struct stat *after,
+                 size_t tree_chunk, const uint8_t *digest);
+int cache_close(digest_cache *cache);
+
+#endif // DIGEST_CACHE_H
@@ -0,0 +1,108 @@
+#include "dir_digest.h"
+#include "sm3.h"
+#include "walk.h"
+#include "file_handler.h"
+#include "checkpoint.h"
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+/*
+ * SM3DIR of a directory D is the SM3 of a manifest that is never written out:
+ *   "SM3DIR" 0x00 || entry || entry || ...
+ *   entry = kind || be64(length of P) || P || content
+ * P is the path of the entry relative to D, entries are in the order of walk_paths()
+ * ('/' sorts before any other byte), kind is one byte:
+ *   'f' regular file, content = the 32 byte SM3 of the file
+ *   'd' directory, no content (so empty directories count)
+ *   'l' symbolic link, content = be64(length of T) || T, T being the link target
+ * Everything else (devices, fifos, sockets) is left out, so are owners, modes and times.
+ * Lengths in front of every string make the encoding unambiguous for any file name.
+ */
+
+#define DIR_MAGIC "SM3DIR" // hashed with its terminating 0
+
+static void no_report(sm3_file_job *job, void *arg) {
+    (void)job;
+    (void)arg;
+}
+
+static void put_string(sm3_ctx *ctx, const char *str, size_t len) {
+    uint64_t len_be = local_to_be(len);
+    sm3_update(ctx, &len_be, sizeof(len_be));
+    sm3_update(ctx, str, len);
+}
+
+/*
+ * root: directory to digest
+ * threads: number of threads walking the directory and hashing its files
+ * report: called for every regular file in manifest order once it is hashed, may be NULL
+ * digest: at least SM3_DIGEST_SIZE bytes, receives the SM3DIR digest
+ * return: 0 on success, -1 if an entry could not be read, digest is not set then
+ */
+int dir_digest(char *root, int threads, sm3_job_report report, void *arg, uint8_t *digest) {
+    walk_options options = {sm3_args.follow_symlinks, sm3_args.one_file_system, true,
+                            sm3_args.resume_interval != 0 ? CHECKPOINT_SUFFIX : NULL};
+    size_t count, nfiles = 0;
+    char *types;
+    char **paths = walk_paths(&root, 1, threads, &options, &count, &types);
+    for (size_t i = 0; i < count; i++) {
+        nfiles += types[i] == WALK_FILE;
+    }
+
+    // the file contents are hashed in parallel first, the manifest only takes their digests
+    sm3_file_job *jobs = (sm3_file_job *)calloc(nfiles + 1, sizeof(sm3_file_job));
+    if (jobs == NULL) {
+        fprintf(stderr, "sm3sum: out of memory\n");
+        exit(1);
+    }
+    nfiles = 0;
+    for (size_t i = 0; i < count; i++) {
+        if (types[i] == WALK_FILE) {
+            jobs[nfiles++].file_name = paths[i];
+        }
+    }
+    hash_files(jobs, nfiles, threads, report != NULL ? report : no_report, arg);
+
+    size_t root_len = strlen(root);
+    size_t skip = root_len + (root_len > 0 && root[root_len - 1] != '/');
+    int ret = 0;
+    sm3_ctx ctx;
+    sm3_init(&ctx);
+    sm3_update(&ctx, DIR_MAGIC, sizeof(DIR_MAGIC));
+    nfiles = 0;
+    for (size_t i = 0; i < count && ret == 0; i++) {
+        const char *rel = paths[i] + skip;
+        sm3_update(&ctx, &types[i], 1);
+        put_string(&ctx, rel, strlen(rel));
+        if (types[i] == WALK_FILE) {
+            sm3_file_job *job = &jobs[nfiles++];
+            if (job->failed) {
+                fprintf(stderr, "sm3sum: cannot read %s\n", job->file_name);
+                ret = -1;
+                break;
+            }
+            sm3_update(&ctx, job->digest, SM3_DIGEST_SIZE);
+        } else if (types[i] == WALK_LINK) {
+            char target[PATH_LIMIT * 4];
+            ssize_t len = readlink(paths[i], target, sizeof(target));
+            if (len < 0 || (size_t)len == sizeof(target)) {
+                fprintf(stderr, "sm3sum: cannot read symbolic link %s\n", paths[i]);
+                ret = -1;
+                break;
+            }
+            put_string(&ctx, target, len);
+        }
+    }
+    if (ret == 0) {
+        sm3_final(&ctx, digest);
+    }
+    free(jobs);
+    free(types);
+    free(paths);
+    return ret;
+}
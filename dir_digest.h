@@ -0,0 +1,14 @@
+#ifndef DIR_DIGEST_H
+#define DIR_DIGEST_H
+#include <stdint.h>
+#include <stdbool.h>
+#include "file_handler.h"
+/*
+ * This header contains declearations of the directory digest, one SM3 value
+ * over the names, kinds and contents of everything below a directory
+ */
+#define DIR_TAG "SM3DIR"
+
+int dir_digest(char *root, int threads, sm3_job_report report, void *arg, uint8_t *digest);
+
+#endif // DIR_DIGEST_H
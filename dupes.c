@@ -0,0 +1,265 @@
+#include "dupes.h"
+#include "sm3.h"
+#include "file_handler.h"
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+/*
+ * Files are narrowed down in three stages, each one only looking at what the one before
+ * could not tell apart:
+ *   1. size, from stat(); names of the same (dev, inode) are one file and counted once
+ *   2. SM3 of the first DUP_PREFIX_SIZE bytes, for files sharing their size
+ *   3. SM3 of the whole file, through hash_files(), for files sharing size and prefix
+ * Files no longer than the prefix are done after stage 2. Groups are printed as GNU digest
+ * lines in the order of their first file, separated by an empty line.
+ */
+
+#define DUP_PREFIX_SIZE 4096
+
+typedef struct {
+    char *name;
+    size_t order; // position in the list given, groups keep it
+    uint64_t size;
+    dev_t dev;
+    ino_t ino;
+    bool failed;
+    bool full; // digest is that of the whole file
+    uint8_t digest[SM3_DIGEST_SIZE];
+} dup_file;
+
+typedef struct {
+    dup_file **files;
+    size_t count;
+    size_t next; // taken atomically by the prefix threads
+} prefix_pool;
+
+static int by_size_inode(const void *a, const void *b) {
+    const dup_file *x = (const dup_file *)a, *y = (const dup_file *)b;
+    if (x->size != y->size) {
+        return x->size < y->size ? -1 : 1;
+    }
+    if (x->dev != y->dev) {
+        return x->dev < y->dev ? -1 : 1;
+    }
+    if (x->ino != y->ino) {
+        return x->ino < y->ino ? -1 : 1;
+    }
+    return x->order < y->order ? -1 : x->order > y->order;
+}
+
+static int by_size_digest(const void *a, const void *b) {
+    const dup_file *x = *(dup_file *const *)a, *y = *(dup_file *const *)b;
+    if (x->size != y->size) {
+        return x->size < y->size ? -1 : 1;
+    }
+    int c = memcmp(x->digest, y->digest, SM3_DIGEST_SIZE);
+    if (c != 0) {
+        return c;
+    }
+    return x->order < y->order ? -1 : x->order > y->order;
+}
+
+static int by_first_order(const void *a, const void *b) {
+    const dup_file *x = **(dup_file **const *)a, *y = **(dup_file **const *)b;
+    return x->order < y->order ? -1 : x->order > y->order;
+}
+
+/*
+ * function: stage 2, digest the first DUP_PREFIX_SIZE bytes of the files of the pool
+ */
+static void *prefix_run(void *arg) {
+    prefix_pool *pool = (prefix_pool *)arg;
+    uint8_t buf[DUP_PREFIX_SIZE];
+    size_t i;
+    while ((i = __atomic_fetch_add(&pool->next, 1, __ATOMIC_RELAXED)) < pool->count) {
+        dup_file *file = pool->files[i];
+        size_t want = file->size < DUP_PREFIX_SIZE ? file->size : DUP_PREFIX_SIZE;
+        size_t got = 0;
+        int fd = open_input(file->name);
+        while (fd >= 0 && got < want) {
+            ssize_t n = pread(fd, buf + got, want - got, got);
+            if (n < 0 && errno == EINTR) {
+                continue;
+            }
+            if (n <= 0) {
+                break;
+            }
+            got += n;
+        }
+        file->failed = fd < 0 || got < want;
+        if (fd >= 0) {
+            close(fd);
+        }
+        sm3(buf, got, file->digest);
+        file->full = file->size <= DUP_PREFIX_SIZE;
+    }
+    return NULL;
+}
+
+static void prefix_digests(dup_file **files, size_t count, int threads) {
+    prefix_pool pool = {files, count, 0};
+    pthread_t *tids = (pthread_t *)calloc(threads, sizeof(pthread_t));
+    if (threads > (int)count) {
+        threads = (int)count;
+    }
+    if (tids == NULL || threads <= 1) {
+        prefix_run(&pool);
+        free(tids);
+        return;
+    }
+    for (int t = 0; t < threads; t++) {
+        pthread_create(&tids[t], NULL, prefix_run, &pool);
+    }
+    for (int t = 0; t < threads; t++) {
+        pthread_join(tids[t], NULL);
+    }
+    free(tids);
+}
+
+static void full_report(sm3_file_job *job, void *arg) {
+    (void)arg;
+    dup_file *file = (dup_file *)job->priv;
+    file->failed = job->failed;
+    memcpy(file->digest, job->digest, SM3_DIGEST_SIZE);
+    file->full = true;
+}
+
+/*
+ * function: move the files of runs of at least two equal keys to the front
+ * return: number of files kept
+ */
+static size_t keep_colliding(dup_file **files, size_t count, int (*cmp)(const void *, const void *)) {
+    size_t kept = 0;
+    for (size_t i = 0, j; i < count; i = j) {
+        for (j = i + 1; j < count && cmp(&files[i], &files[j]) == 0; j++) {
+        }
+        if (j - i < 2) {
+            continue;
+        }
+        for (size_t k = i; k < j; k++) {
+            files[kept++] = files[k];
+        }
+    }
+    return kept;
+}
+
+/*
+ * key compares for keep_colliding(), without the order
+ */
+static int same_size(const void *a, const void *b) {
+    return (*(dup_file *const *)a)->size != (*(dup_file *const *)b)->size;
+}
+
+static int same_content(const void *a, const void *b) {
+    const dup_file *x = *(dup_file *const *)a, *y = *(dup_file *const *)b;
+    return x->size != y->size || x->full != y->full || memcmp(x->digest, y->digest, SM3_DIGEST_SIZE) != 0;
+}
+
+/*
+ * function: report the files that could not be read and leave them out
+ * return: number of files kept
+ */
+static size_t drop_failed(dup_file **files, size_t count) {
+    size_t kept = 0;
+    for (size_t i = 0; i < count; i++) {
+        if (files[i]->failed) {
+            printf("Cannot access file %s, either non-existing or not readable\n", files[i]->name);
+        } else {
+            files[kept++] = files[i];
+        }
+    }
+    return kept;
+}
+
+/*
+ * names: the files to compare, count entries
+ * threads: number of threads reading prefixes and hashing
+ * function: print every group of files with the same contents
+ */
+void find_duplicates(char **names, size_t count, int threads) {
+    dup_file *all = (dup_file *)calloc(count + 1, sizeof(dup_file));
+    dup_file **files = (dup_file **)calloc(count + 1, sizeof(dup_file *));
+    if (all == NULL || files == NULL) {
+        fprintf(stderr, "sm3sum: out of memory\n");
+        exit(1);
+    }
+    size_t n = 0;
+    for (size_t i = 0; i < count; i++) {
+        struct stat st;
+        if (stat(names[i], &st) != 0) {
+            printf("Cannot access file %s, either non-existing or not readable\n", names[i]);
+            continue;
+        }
+        if (!S_ISREG(st.st_mode)) {
+            continue;
+        }
+        all[n].name = names[i];
+        all[n].order = i;
+        all[n].size = st.st_size;
+        all[n].dev = st.st_dev;
+        all[n].ino = st.st_ino;
+        ++n;
+    }
+
+    // stage 1, the first name of an inode stands for all its hard links
+    qsort(all, n, sizeof(dup_file), by_size_inode);
+    size_t m = 0;
+    for (size_t i = 0; i < n; i++) {
+        if (m == 0 || files[m - 1]->dev != all[i].dev || files[m - 1]->ino != all[i].ino) {
+            files[m++] = &all[i];
+        }
+    }
+    m = keep_colliding(files, m, same_size);
+
+    // stage 2
+    prefix_digests(files, m, threads);
+    m = drop_failed(files, m);
+    qsort(files, m, sizeof(dup_file *), by_size_digest);
+    m = keep_colliding(files, m, same_content);
+
+    // stage 3, only files longer than their prefix are left to hash
+    sm3_file_job *jobs = (sm3_file_job *)calloc(m + 1, sizeof(sm3_file_job));
+    size_t njobs = 0;
+    for (size_t i = 0; i < m; i++) {
+        if (!files[i]->full) {
+            jobs[njobs].file_name = files[i]->name;
+            jobs[njobs++].priv = files[i];
+        }
+    }
+    hash_files(jobs, njobs, threads, full_report, NULL);
+    free(jobs);
+    m = drop_failed(files, m);
+    qsort(files, m, sizeof(dup_file *), by_size_digest);
+    m = keep_colliding(files, m, same_content);
+
+    // groups start where the content changes, each sorted by order already
+    dup_file ***groups = (dup_file ***)calloc(m + 1, sizeof(dup_file **));
+    size_t ngroups = 0;
+    for (size_t i = 0; i < m; i++) {
+        if (i == 0 || same_content(&files[i - 1], &files[i]) != 0) {
+            groups[ngroups++] = &files[i];
+        }
+    }
+    qsort(groups, ngroups, sizeof(dup_file **), by_first_order);
+    for (size_t g = 0; g < ngroups; g++) {
+        if (g > 0) {
+            putchar(sm3_args.zero ? 0 : '\n');
+        }
+        dup_file **file = groups[g];
+        do {
+            digest_line(NULL, (*file)->digest, (*file)->name);
+            ++file;
+        } while (file < files + m && same_content(file - 1, file) == 0);
+    }
+    free(groups);
+    free(files);
+    free(all);
+}
@@ -0,0 +1,11 @@
+#ifndef DUPES_H
+#define DUPES_H
+#include <stddef.h>
+/*
+ * This header contains declearations of --find-duplicates, which reports
+ * groups of files with identical contents, hashing as little as it can
+ */
+
+void find_duplicates(char **names, size_t count, int threads);
+
+#endif // DUPES_H
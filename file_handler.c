@@ -1,15 +1,116 @@
+#define _GNU_SOURCE // O_NOATIME
 #include "file_handler.h"
 #include <sys/stat.h>
-#include <ctype.h>
 #include <memory.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <unistd.h>
 #include "sm3.h"
+#include "sm3_mb.h"
+#include "tree_hash.h"
+#include "read_pipeline.h"
+#include "digest_cache.h"
+#include "checkpoint.h"
+#include "stats.h"
+#include "hmac.h"
+#include <fcntl.h>
+#include <stdint.h>
+#include <sys/mman.h>
 #include <assert.h>
+#include <pthread.h>
+#include <errno.h>
 
 file_sm3_pair hash_pair_head, *hash_pair_tail;
 
+static const char hex_digits[16] = "0123456789abcdef";
+
+/*
+ * digest: SM3_DIGEST_SIZE bytes hash value
+ * hex: receives 2 * SM3_DIGEST_SIZE lowercase hex digits, not NUL terminated
+ */
+void sm3_hex(const uint8_t *digest, char *hex) {
+    for (int i = 0; i < SM3_DIGEST_SIZE; i++) {
+        hex[2 * i] = hex_digits[digest[i] >> 4];
+        hex[2 * i + 1] = hex_digits[digest[i] & 0xf];
+    }
+}
+
+/*
+ * function: copy a file name into a digest line, escaped as unescape_name() reads it back
+ * return: end of the name in out
+ */
+static char *put_name(char *out, const char *name, size_t len, bool escape) {
+    if (!escape) {
+        memcpy(out, name, len);
+        return out + len;
+    }
+    for (size_t i = 0; i < len; i++) {
+        switch (name[i]) {
+        case '\\': *out++ = '\\'; *out++ = '\\'; break;
+        case '\n': *out++ = '\\'; *out++ = 'n'; break;
+        case '\r': *out++ = '\\'; *out++ = 'r'; break;
+        default: *out++ = name[i];
+        }
+    }
+    return out;
+}
+
+#define DIGEST_LINE_MAX 4352 // lines up to this long are put together on the stack
+
+/*
+ * tag: BSD style tag, the line is then "TAG (NAME) = HASH", NULL for GNU style "HASH  NAME"
+ * digest: SM3_DIGEST_SIZE bytes hash value
+ * function: print one digest line with a single fwrite(); with -z the line ends with NUL and the
+ * name is taken as it is, otherwise a name holding a backslash or a line break is escaped and the
+ * line starts with a backslash, as GNU sha256sum does
+ */
+void digest_line(const char *tag, const uint8_t *digest, const char *file_name) {
+    char stack_line[DIGEST_LINE_MAX];
+    size_t name_len = strlen(file_name);
+    size_t tag_len = tag != NULL ? strlen(tag) : 0;
+    bool escape = !sm3_args.zero && strpbrk(file_name, "\\\n\r") != NULL;
+    // backslash, tag, " (", name, ") = ", hash, end of line
+    size_t size = 1 + tag_len + 2 + 2 * name_len + 4 + 2 * SM3_DIGEST_SIZE + 1;
+    char *line = size <= sizeof(stack_line) ? stack_line : (char *)malloc(size);
+    if (line == NULL) {
+        fprintf(stderr, "sm3sum: out of memory\n");
+        exit(1);
+    }
+    char *p = line;
+    if (escape) {
+        *p++ = '\\';
+    }
+    if (tag != NULL) {
+        memcpy(p, tag, tag_len);
+        p += tag_len;
+        memcpy(p, " (", 2);
+        p = put_name(p + 2, file_name, name_len, escape);
+        memcpy(p, ") = ", 4);
+        sm3_hex(digest, p + 4);
+        p += 4 + 2 * SM3_DIGEST_SIZE;
+    } else {
+        sm3_hex(digest, p);
+        p += 2 * SM3_DIGEST_SIZE;
+        memcpy(p, "  ", 2);
+        p = put_name(p + 2, file_name, name_len, escape);
+    }
+    *p++ = sm3_args.zero ? 0 : '\n';
+    fwrite(line, 1, p - line, stdout);
+    if (line != stack_line) {
+        free(line);
+    }
+}
+
+/*
+ * digest: SM3_DIGEST_SIZE bytes hash value
+ * function: print the sm3 result, BSD style with --tag
+ */
+void sm3_print(const uint8_t *digest, const char *file_name) {
+    const char *tag = sm3_args.hmac_key != NULL ? HMAC_TAG : "SM3";
+    digest_line(sm3_args.bsd_tag ? tag : NULL, digest, file_name);
+}
+
+
 /*
  * initialize link list head
  */
@@ -18,164 +119,1075 @@ void parse_checklist_init() {
     hash_pair_tail = &hash_pair_head;
 }
 
+#define PAIR_ARENA_BLOCK 4096 // pairs allocated at once, they live until exit
+
 /*
- * convert sm3 string to int array
- * sm3_str: char array that contains sm3 string
- * return: uint32_t array
+ * return: a new pair, carved out of a block shared with the pairs before and after it
  */
-uint32_t *sm3str2int(char *sm3_str) {
-    uint32_t *ret = malloc(sizeof(uint32_t) * 8);
-    for (int i = 0; i < 8; i++) {
-        uint32_t result = 0;
-        for (int j = 0; j < 8; j++) {
-            uint32_t tmp = tolower(sm3_str[i * 8 + j]);
-            result = result << 4 | (isdigit(tmp) ? tmp - '0' : tmp - 'a' + 10);
+static file_sm3_pair *pair_alloc() {
+    static file_sm3_pair *block;
+    static size_t left;
+    if (left == 0) {
+        block = (file_sm3_pair *)malloc(PAIR_ARENA_BLOCK * sizeof(file_sm3_pair));
+        if (block == NULL) {
+            fprintf(stderr, "sm3sum: out of memory\n");
+            exit(1);
         }
-        ret[i] = local_to_be32(result);
+        left = PAIR_ARENA_BLOCK;
     }
-    return ret;
+    return &block[PAIR_ARENA_BLOCK - left--];
+}
+
+// value of a hex digit plus one, 0 for anything else
+static const uint8_t hex_value[256] = {
+    ['0'] = 1, ['1'] = 2, ['2'] = 3, ['3'] = 4, ['4'] = 5,
+    ['5'] = 6, ['6'] = 7, ['7'] = 8, ['8'] = 9, ['9'] = 10,
+    ['a'] = 11, ['b'] = 12, ['c'] = 13, ['d'] = 14, ['e'] = 15, ['f'] = 16,
+    ['A'] = 11, ['B'] = 12, ['C'] = 13, ['D'] = 14, ['E'] = 15, ['F'] = 16,
+};
+
+/*
+ * hex: 2 * SM3_DIGEST_SIZE characters
+ * digest: receives SM3_DIGEST_SIZE bytes
+ * return: 0 on success, -1 if hex has a character that is not a hex digit
+ */
+static int hex_decode(const char *hex, uint8_t *digest) {
+    uint8_t bad = 0;
+    for (int i = 0; i < SM3_DIGEST_SIZE; i++) {
+        uint8_t hi = hex_value[(uint8_t)hex[2 * i]], lo = hex_value[(uint8_t)hex[2 * i + 1]];
+        // no branch per digit, invalid ones are collected and checked once
+        bad |= (uint8_t)(hi == 0) | (uint8_t)(lo == 0);
+        digest[i] = (uint8_t)((hi - 1) << 4 | (lo - 1));
+    }
+    return bad ? -1 : 0;
+}
+
+/*
+ * name, len: an escaped file name, as GNU sha256sum writes it after a leading backslash
+ * function: undo \\ and \n (and \r) in place and terminate the name
+ * return: 0 on success, -1 on an unknown escape
+ */
+static int unescape_name(char *name, size_t len) {
+    char *out = name;
+    for (size_t i = 0; i < len; i++) {
+        if (name[i] != '\\') {
+            *out++ = name[i];
+            continue;
+        }
+        if (++i == len) {
+            return -1;
+        }
+        switch (name[i]) {
+        case '\\': *out++ = '\\'; break;
+        case 'n': *out++ = '\n'; break;
+        case 'r': *out++ = '\r'; break;
+        default: return -1;
+        }
+    }
+    *out = 0;
+    return 0;
 }
 
 /*
  * parse the output of sm3sum for the purpose of verifying
- * buf: a buffer that contains the output of a previous sm3sum
- * bsize: size of the buffer in bytes
-*/
-void parse_checklist(char *buf, size_t bsize) {
-    // note that BSD format and default format differs here
-    char *filename_str, *hash_str;
-    filename_str = (char *)malloc(PATH_LIMIT + 1);
-    hash_str = (char *)malloc(HASH_LIMIT + 1);
-    int readin;
-    if (sm3_args.bsd_tag) {
-        // SM3 (FILENAME) = HASH
-        readin = sscanf(buf, "SM3 %1024s = %64s", filename_str, hash_str);
-        memmove(filename_str, filename_str+1, strlen(filename_str)); // remove (
-        filename_str[strlen(filename_str) - 1] = 0; // remove )
+ * buf: one line of a previous sm3sum output, without its newline, tokenized in place:
+ * buf[bsize] must be writable and buf must outlive the check, file names point into it
+ * bsize: size of the line in bytes
+ * function: GNU (HASH  NAME, HASH *NAME), BSD (SM3 (NAME) = HASH) and SM3TREE lines are
+ * told apart line by line; a leading backslash marks a GNU escaped file name; HMAC-SM3 lines
+ * are only taken with --hmac-key-file
+ * return: 0 on success, -1 if the line is improperly formatted
+ */
+int parse_checklist(char *buf, size_t bsize) {
+    const size_t hex_len = 2 * SM3_DIGEST_SIZE;
+    size_t tree_chunk = 0;
+    bool escaped = false;
+    char *name, *hash;
+    size_t name_len;
+    if (bsize > 0 && buf[bsize - 1] == '\r') {
+        --bsize;
+    }
+    if (bsize > 0 && buf[0] == '\\') {
+        escaped = true;
+        ++buf;
+        --bsize;
+    }
+
+    bool tree = bsize > strlen(TREE_TAG) && strncmp(buf, TREE_TAG, strlen(TREE_TAG)) == 0;
+    bool hmac = bsize > strlen(HMAC_TAG) && strncmp(buf, HMAC_TAG, strlen(HMAC_TAG)) == 0;
+    if (hmac && sm3_args.hmac_key == NULL) {
+        // a MAC cannot be checked without its key
+        return -1;
+    }
+    if (hmac) {
+        buf += strlen(HMAC_TAG) - 3;
+        bsize -= strlen(HMAC_TAG) - 3;
+    }
+    if (tree || (bsize > 3 && strncmp(buf, "SM3", 3) == 0 && (buf[3] == ' ' || buf[3] == '('))) {
+        // SM3 (NAME) = HASH, HMAC-SM3 (NAME) = HASH or SM3TREE-CHUNK (NAME) = HASH, the name may hold
+        // anything but a newline, so it ends at the last ')' before the hash
+        char *p = buf + 3;
+        if (tree) {
+            char *end;
+            tree_chunk = strtoull(buf + strlen(TREE_TAG), &end, 10);
+            if (tree_chunk == 0 || end == buf + strlen(TREE_TAG)) {
+                return -1;
+            }
+            p = end;
+        }
+        if (*p == ' ') {
+            ++p;
+        }
+        if (bsize < hex_len + 4 || *p != '(') {
+            return -1;
+        }
+        name = p + 1;
+        hash = buf + bsize - hex_len;
+        char *close = hash - 1;
+        // ") = ", ")= " or ")="
+        if (*close == ' ') {
+            --close;
+        }
+        if (*close != '=' || close <= name) {
+            return -1;
+        }
+        --close;
+        if (*close == ' ') {
+            --close;
+        }
+        if (close < name || *close != ')') {
+            return -1;
+        }
+        name_len = close - name;
     } else {
-        // HASH FILENAME
-        readin = sscanf(buf, "%64s%1024s", hash_str, filename_str);
+        // HASH NAME, GNU puts a space or a * for binary mode before the name
+        if (bsize < hex_len + 2 || buf[hex_len] != ' ') {
+            return -1;
+        }
+        hash = buf;
+        name = buf + hex_len + 1;
+        if ((*name == ' ' || *name == '*') && name < buf + bsize - 1) {
+            ++name;
+        }
+        name_len = buf + bsize - name;
     }
-    if (readin < 2) {
-        // format error
-        printf("File list illgal format error\n");
-        exit(1);
+    if (name_len == 0) {
+        return -1;
+    }
+
+    uint8_t digest[SM3_DIGEST_SIZE];
+    if (hex_decode(hash, digest) != 0) {
+        return -1;
+    }
+    if (escaped) {
+        if (unescape_name(name, name_len) != 0) {
+            return -1;
+        }
+    } else {
+        name[name_len] = 0;
     }
 
-    if (strcmp(filename_str, "-") != 0) {
-        file_sm3_pair *new_file_pair = malloc(sizeof(file_sm3_pair));
+    if (strcmp(name, "-") != 0) {
+        file_sm3_pair *new_file_pair = pair_alloc();
         new_file_pair->next = NULL;
-        new_file_pair->file_name = filename_str;
-        uint32_t *expected = sm3str2int(hash_str);
-        memcpy(new_file_pair->expected_sm3, expected, sizeof(uint32_t) * 8);
-        free(expected);
+        new_file_pair->file_name = name;
+        new_file_pair->tree_chunk = tree_chunk;
+        memcpy(new_file_pair->expected_sm3, digest, SM3_DIGEST_SIZE);
         hash_pair_tail->next = new_file_pair;
         hash_pair_tail = new_file_pair;
     }
-
-    free(hash_str);
+    return 0;
 }
 
-
 /*
- * get the file size in bytes
- * filename: file name in char array
- * return: file size in bytes
+ * fd: a check list, read from its current offset
+ * size: receives the number of bytes
+ * return: the whole content, writable and followed by one spare byte, NULL on failure;
+ * regular files are mapped privately so that only pages tokenized get copied
  */
-size_t get_file_size(char *filename) {
+static char *load_checklist(int fd, size_t *size) {
     struct stat st;
-    stat(filename, &st);
-    return st.st_size;
+    long page = sysconf(_SC_PAGESIZE);
+    if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0 && lseek(fd, 0, SEEK_CUR) == 0 &&
+        (uint64_t)st.st_size < SIZE_MAX && st.st_size % page != 0) {
+        // the tail of the last page is zero filled, which is the spare byte
+        void *map = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+        if (map != MAP_FAILED) {
+            madvise(map, st.st_size, MADV_SEQUENTIAL);
+            *size = st.st_size;
+            return (char *)map;
+        }
+    }
+    // a pipe, or no room after the end of the mapping
+    size_t cap = 1 << 16, len = 0;
+    char *buf = (char *)malloc(cap);
+    while (buf != NULL) {
+        if (len + 1 == cap) {
+            char *bigger = (char *)realloc(buf, cap * 2);
+            if (bigger == NULL) {
+                break;
+            }
+            buf = bigger;
+            cap *= 2;
+        }
+        ssize_t got = read(fd, buf + len, cap - 1 - len);
+        if (got < 0 && errno == EINTR) {
+            continue;
+        }
+        if (got < 0) {
+            break;
+        }
+        if (got == 0) {
+            *size = len;
+            return buf;
+        }
+        len += got;
+    }
+    free(buf);
+    return NULL;
 }
 
 /*
  * parse the input of sm3sum if check mode is enabled
+ * the check lists are kept in memory until exit, the parsed names point into them
  */
 void parse_filelist() {
-    FILE *check_file;
-    char *check_buf = (char *)malloc(PATH_LIMIT + HASH_LIMIT + 15);
-    size_t buf_len;
     if (sm3_args.check_mode) {
         parse_checklist_init();
         // only update file name-hash pair in check mode
         file_list *file_ptr = sm3_args.head.next;
         while (file_ptr != NULL) {
-            if (1/*access(file_ptr->file_name, R_OK)*/) {
-                // we are able to read from this file
-                check_file = fopen(file_ptr->file_name, "r");
-                while (fgets(check_buf, PATH_LIMIT + HASH_LIMIT + 10, check_file) != NULL) {
-                    // each line need to be parsed
-                    buf_len = strlen(check_buf);
-                    parse_checklist(check_buf, buf_len);
-                }
-                fclose(check_file);
-            } else {
+            bool from_stdin = strcmp(file_ptr->file_name, "-") == 0;
+            int fd = from_stdin ? STDIN_FILENO : open(file_ptr->file_name, O_RDONLY);
+            size_t size, bad = 0, good = 0, line_no = 0;
+            char *list = fd < 0 ? NULL : load_checklist(fd, &size);
+            if (fd >= 0 && !from_stdin) {
+                close(fd);
+            }
+            if (list == NULL) {
                 // cannot read file
                 printf("Cannot access file %s, either non-existing or not readable\n", file_ptr->file_name);
+                file_ptr = file_ptr->next;
+                continue;
+            }
+            for (char *line = list; line < list + size; ) {
+                char *end = (char *)memchr(line, '\n', list + size - line);
+                if (end == NULL) {
+                    end = list + size;
+                }
+                ++line_no;
+                if (parse_checklist(line, end - line) == 0) {
+                    ++good;
+                } else {
+                    ++bad;
+                    if (sm3_args.warn) {
+                        fprintf(stderr, "sm3sum: %s: %zu: improperly formatted SM3 checksum line\n",
+                                file_ptr->file_name, line_no);
+                    }
+                }
+                line = end + 1;
+            }
+            if (good == 0) {
+                fprintf(stderr, "sm3sum: %s: no properly formatted SM3 checksum lines found\n", file_ptr->file_name);
+            } else if (bad > 0 && !sm3_args.status) {
+                fprintf(stderr, "sm3sum: WARNING: %zu line%s improperly formatted\n", bad, bad == 1 ? " is" : "s are");
             }
             file_ptr = file_ptr->next;
         }
+    }
+}
+
+#define MAP_WINDOW (8 << 20) // readahead hint distance of the mmap path
 
+/*
+ * fd: file to be mapped
+ * size: receives the file size in bytes
+ * return: read-only mapping of the whole file, NULL if it is not a regular file or cannot be mapped
+ */
+static const uint8_t *map_file(int fd, size_t *size) {
+    struct stat st;
+    if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode) || st.st_size == 0 || (uint64_t)st.st_size > SIZE_MAX) {
+        return NULL;
     }
-    free(check_buf);
-    return ;
+    void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (map == MAP_FAILED) {
+        return NULL;
+    }
+    madvise(map, st.st_size, MADV_SEQUENTIAL);
+    *size = st.st_size;
+    return (const uint8_t *)map;
 }
 
 /*
- * fp: the FILE pointer of data to be calculated
- * file_size: the file size in bits
+ * path: file to be hashed
+ * return: read-only descriptor, -1 on failure; reading it leaves the access time alone
+ * where the caller owns the file, hashing a tree should not dirty every inode in it
  */
-void read_and_calc(FILE *fp, size_t file_size) {
-    // block size: 36MB + 1 block (for padding)
-    uint8_t *buf = (uint8_t *)malloc((BLOCK_BATCH_CNT * 2) * BLOCK_SIZE);
-    size_t calculated = 0;
-    size_t read_succ;
-    V_init();
-    while (calculated + (BLOCK_BATCH_CNT + 1)* BLOCK_SIZE <= file_size) {
-        // read aligned block but leave the last one
-        read_succ = fread(buf, BLOCK_BATCH_CNT * BLOCK_SIZE / 8, 1, fp);
-        assert(read_succ);
-        // does not padding
-        sm3_iterate(buf, BLOCK_BATCH_CNT * BLOCK_SIZE);
-        calculated += BLOCK_SIZE * BLOCK_BATCH_CNT;
-    }
-    #ifdef DEBUG
-    printf("tail begin\n");
-    #endif // DEBUG
-
-    // may not occupy full space, needs clean up
-    memset(buf, 0, (BLOCK_BATCH_CNT * 2) * BLOCK_SIZE);
-    read_succ = fread(buf, file_size - calculated, 1, fp);
-    size_t final_size = file_size - calculated;
-    sm3_padding(buf, &final_size, file_size);
-    assert(final_size % BLOCK_SIZE == 0);
-    // size_t final_block_size = final_size - calculated;
-    sm3_iterate(buf, final_size);
-    free(buf);
+int open_input(const char *path) {
+    int fd = open(path, O_RDONLY | O_NOATIME | O_CLOEXEC);
+    if (fd < 0 && errno == EPERM) {
+        // O_NOATIME is refused on files of other users
+        fd = open(path, O_RDONLY | O_CLOEXEC);
+    }
+    return fd;
+}
+
+/*
+ * regular: fd is a regular file, which only reads short at its end
+ * eof: set once the end of the file is reached
+ * function: fill buf from fd; a regular file smaller than len takes a single read(),
+ * anything else (a fifo given by name) is read until len bytes or its end
+ * return: bytes read, -1 on a read error
+ */
+static ssize_t read_fill(int fd, uint8_t *buf, size_t len, bool regular, bool *eof) {
+    size_t got = 0;
+    while (got < len) {
+        ssize_t n = read(fd, buf + got, len - got);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n < 0) {
+            return -1;
+        }
+        got += n;
+        if (n == 0 || (regular && got < len)) {
+            *eof = true;
+            break;
+        }
+    }
+    return got;
+}
+
+/*
+ * function: start the digest of an input, keyed when --hmac-key-file is given
+ */
+static inline void input_init(sm3_ctx *ctx) {
+    if (sm3_args.hmac_key != NULL) {
+        sm3_hmac_start(ctx, sm3_args.hmac_key);
+    } else {
+        sm3_init(ctx);
+    }
+}
+
+/*
+ * digest: at least SM3_DIGEST_SIZE bytes, receives the SM3 or HMAC-SM3 value
+ */
+static inline void input_final(sm3_ctx *ctx, uint8_t *digest) {
+    if (sm3_args.hmac_key != NULL) {
+        sm3_hmac_finish(ctx, sm3_args.hmac_key->outer, digest);
+    } else {
+        sm3_final(ctx, digest);
+    }
+}
+
+/*
+ * return: bytes of the input hashed so far, without the key block of HMAC-SM3
+ */
+static inline uint64_t input_length(const sm3_ctx *ctx) {
+    return sm3_args.hmac_key != NULL ? ctx->total_len - SM3_BLOCK_BYTES : ctx->total_len;
 }
 
-void stdin_read_and_calc() {
-    // stdin does not ensure size
-    // may end at any point
-    uint8_t *buf = (uint8_t *)malloc(2 * BLOCK_SIZE);
-    size_t calculated = 0;
-    size_t offset = 0;
-    V_init();
-    int c = getchar();
-    while (c != EOF) {
-        buf[offset] = c;
-        ++calculated;
-        ++offset;
-        c = getchar();
-        if (offset == BLOCK_SIZE / 8 && c != EOF) {
-            offset = 0;
-            // ready to calculate
-            sm3_iterate(buf, BLOCK_SIZE);
-        }
-    }
-    memset(buf + offset, 0, 2 * BLOCK_SIZE - offset);
-    offset *= 8;
-    sm3_padding(buf, &offset, calculated * 8);
-    sm3_iterate(buf, offset);
+#define SPARSE_MIN (1 << 20) // smaller files are not worth looking for holes
+#define SPARSE_BUF_SIZE (1 << 20) // read size for the data of a sparse file
+
+static const uint8_t zero_buf[64 << 10]; // hashed in place of the holes of a sparse file
+
+/*
+ * fd: regular file of size bytes, to be hashed from offset on
+ * return: true if the file system reports a hole between offset and size, the file offset
+ * is left at offset
+ */
+static bool file_has_hole(int fd, off_t offset, off_t size) {
+    off_t hole = lseek(fd, offset, SEEK_HOLE);
+    lseek(fd, offset, SEEK_SET);
+    return hole >= 0 && hole < size;
+}
+
+/*
+ * fd: regular file of size bytes, found sparse by file_has_hole()
+ * digest: at least SM3_DIGEST_SIZE bytes, receives the hash value
+ * stats: receives bytes, read and hash times for --stats, NULL when nobody asks
+ * function: hash from offset to size, reading only the data of the file: SEEK_DATA and SEEK_HOLE
+ * find its extents, and the holes, which read back as zeros, are hashed out of zero_buf
+ * return: 0 on success, -1 on a read error or if the file shrank meanwhile
+ */
+static int sparse_hash(int fd, off_t offset, off_t size, uint8_t *digest, sm3_io_stats *stats) {
+    uint8_t *buf = (uint8_t *)malloc(SPARSE_BUF_SIZE);
+    if (buf == NULL) {
+        fprintf(stderr, "sm3sum: out of memory\n");
+        exit(1);
+    }
+    sm3_ctx ctx;
+    int ret = 0;
+    uint64_t now = stats != NULL ? stats_clock() : 0;
+    input_init(&ctx);
+    while (offset < size && ret == 0) {
+        off_t data = lseek(fd, offset, SEEK_DATA);
+        if (data < 0 || data > size) {
+            // ENXIO: nothing but a hole up to the end
+            data = size;
+        }
+        off_t hole = data < size ? lseek(fd, data, SEEK_HOLE) : size;
+        if (hole < 0 || hole > size) {
+            hole = size;
+        }
+        if (stats != NULL) {
+            stats->read_ns += stats_clock() - now;
+            now = stats_clock();
+        }
+        for (size_t len; offset < data; offset += len) {
+            len = data - offset < (off_t)sizeof(zero_buf) ? (size_t)(data - offset) : sizeof(zero_buf);
+            sm3_update(&ctx, zero_buf, len);
+        }
+        if (stats != NULL) {
+            stats->hash_ns += stats_clock() - now;
+            now = stats_clock();
+        }
+        while (offset < hole) {
+            size_t len = hole - offset < SPARSE_BUF_SIZE ? hole - offset : SPARSE_BUF_SIZE;
+            ssize_t got = pread(fd, buf, len, offset);
+            if (got < 0 && errno == EINTR) {
+                continue;
+            }
+            if (got <= 0) {
+                ret = -1;
+                break;
+            }
+            if (stats != NULL) {
+                stats->read_ns += stats_clock() - now;
+                now = stats_clock();
+            }
+            sm3_update(&ctx, buf, got);
+            offset += got;
+            if (stats != NULL) {
+                stats->hash_ns += stats_clock() - now;
+                now = stats_clock();
+            }
+        }
+    }
+    input_final(&ctx, digest);
+    if (stats != NULL) {
+        stats->bytes = input_length(&ctx);
+    }
+    lseek(fd, offset, SEEK_SET);
     free(buf);
-}
\ No newline at end of file
+    return ret;
+}
+
+/*
+ * fp: the FILE pointer of data to be calculated, nothing must have been read through it yet
+ * digest: at least SM3_DIGEST_SIZE bytes, receives the hash value
+ * stats: receives bytes, read and hash times for --stats, NULL when nobody asks
+ * function: regular files are hashed straight out of the page cache (unless --io or --direct ask
+ * otherwise), anything that cannot be mapped goes through the read pipeline, so that reading and
+ * hashing overlap; large sparse files only have their data read, whatever the --io mode
+ * return: 0 on success, -1 on a read error
+ */
+int read_and_calc(FILE *fp, uint8_t *digest, sm3_io_stats *stats) {
+    int fd = fileno(fp);
+    size_t map_size;
+    const uint8_t *map = NULL;
+    bool drop_behind = false;
+    struct stat st;
+    off_t offset;
+    if (!sm3_args.direct && fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size >= SPARSE_MIN &&
+        (offset = lseek(fd, 0, SEEK_CUR)) >= 0 && file_has_hole(fd, offset, st.st_size)) {
+        return sparse_hash(fd, offset, st.st_size, digest, stats);
+    }
+    if (sm3_args.direct) {
+        struct stat st;
+        // O_DIRECT changes what writers of a pipe see, only files get it
+        if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && !set_direct_io(fd, true)) {
+            // no direct io on this file system, evict what has been hashed instead
+            drop_behind = true;
+        }
+    } else if (sm3_args.io_mode == IO_MMAP && lseek(fd, 0, SEEK_CUR) == 0) {
+        // a file descriptor inherited part way through is hashed from where it stands
+        map = map_file(fd, &map_size);
+    }
+    if (map != NULL) {
+        sm3_ctx ctx;
+        uint64_t start = stats != NULL ? stats_clock() : 0;
+        input_init(&ctx);
+        for (size_t offset = 0; offset < map_size; offset += MAP_WINDOW) {
+            size_t len = map_size - offset < MAP_WINDOW ? map_size - offset : MAP_WINDOW;
+            if (offset + len < map_size) {
+                // ask for the next window while this one is hashed
+                size_t ahead = map_size - offset - len < MAP_WINDOW ? map_size - offset - len : MAP_WINDOW;
+                madvise((void *)(map + offset + len), ahead, MADV_WILLNEED);
+            }
+            // only the last partial block is copied, into ctx
+            sm3_update(&ctx, map + offset, len);
+        }
+        input_final(&ctx, digest);
+        munmap((void *)map, map_size);
+        if (stats != NULL) {
+            stats->bytes = map_size;
+            stats->hash_ns = stats_clock() - start;
+        }
+        return 0;
+    }
+
+    sm3_ctx ctx;
+    input_init(&ctx);
+    read_pipeline *pipe = pipeline_open(fd, sm3_args.io_mode != IO_THREAD);
+    if (pipe != NULL) {
+        const uint8_t *data;
+        size_t len;
+        off_t done = lseek(fd, 0, SEEK_CUR);
+        uint64_t now = stats != NULL ? stats_clock() : 0;
+        while ((data = pipeline_next(pipe, &len)) != NULL && len > 0) {
+            if (stats != NULL) {
+                stats->read_ns += stats_clock() - now;
+                now = stats_clock();
+            }
+            sm3_update(&ctx, data, len);
+            if (stats != NULL) {
+                stats->hash_ns += stats_clock() - now;
+                now = stats_clock();
+            }
+            if (drop_behind) {
+                posix_fadvise(fd, done, len, POSIX_FADV_DONTNEED);
+            }
+            done += len;
+        }
+        pipeline_close(pipe);
+        input_final(&ctx, digest);
+        if (stats != NULL) {
+            stats->bytes = input_length(&ctx);
+        }
+        return data == NULL ? -1 : 0;
+    }
+
+    // out of memory for the pipeline, a small buffer still works, but not with O_DIRECT
+    set_direct_io(fd, false);
+    size_t buf_size = BLOCK_BATCH_CNT * SM3_BLOCK_BYTES;
+    uint8_t buf[BLOCK_BATCH_CNT * SM3_BLOCK_BYTES];
+    size_t read_succ;
+    uint64_t now = stats != NULL ? stats_clock() : 0;
+    while ((read_succ = fread(buf, 1, buf_size, fp)) > 0) {
+        if (stats != NULL) {
+            stats->read_ns += stats_clock() - now;
+            now = stats_clock();
+        }
+        sm3_update(&ctx, buf, read_succ);
+        if (stats != NULL) {
+            stats->hash_ns += stats_clock() - now;
+            now = stats_clock();
+        }
+    }
+    input_final(&ctx, digest);
+    if (stats != NULL) {
+        stats->bytes = input_length(&ctx);
+    }
+    return ferror(fp) ? -1 : 0;
+}
+
+/*
+ * digest: at least SM3_DIGEST_SIZE bytes, receives the hash value
+ * stats: receives what reading stdin took for --stats, NULL when nobody asks
+ * function: stdin takes the same paths as a named file: a regular file redirected to stdin
+ * is mapped, a pipe is read in PIPELINE_BUF_SIZE pieces by the read pipeline
+ * return: 0 on success, -1 on a read error
+ */
+int stdin_read_and_calc(uint8_t *digest, sm3_io_stats *stats) {
+    return read_and_calc(stdin, digest, stats);
+}
+
+/*
+ * fd: a regular file opened by open_input(), found smaller than buf_size by fstat()
+ * buf: buf_size bytes of scratch owned by the caller
+ * function: read the whole file with one read() and hash it from buf, with no stdio buffer,
+ * no mapping and no copy in between
+ * return: 0 on success, -1 on a read error, 1 if the file has grown to buf_size since fstat(),
+ * fd is then back at its start for the streaming path
+ */
+static int small_file_hash(int fd, uint8_t *buf, size_t buf_size, uint8_t *digest, sm3_io_stats *stats) {
+    bool eof = false;
+    uint64_t start = stats != NULL ? stats_clock() : 0;
+    ssize_t len = read_fill(fd, buf, buf_size, true, &eof);
+    if (len < 0) {
+        return -1;
+    }
+    if (!eof) {
+        return lseek(fd, 0, SEEK_SET) == 0 ? 1 : -1;
+    }
+    uint64_t now = stats != NULL ? stats_clock() : 0;
+    sm3_ctx ctx;
+    input_init(&ctx);
+    sm3_update(&ctx, buf, len);
+    input_final(&ctx, digest);
+    if (stats != NULL) {
+        stats->bytes = len;
+        stats->read_ns = now - start;
+        stats->hash_ns = stats_clock() - now;
+    }
+    return 0;
+}
+
+#define CACHE_LINE 64
+
+/*
+ * files shared by the workers of hash_files()
+ * next is handed out atomically and sits on its own cache line,
+ * so that workers taking jobs do not disturb the reporting thread
+ */
+typedef struct {
+    sm3_file_job *jobs;
+    size_t count;
+    int threads;
+    sm3_job_report report;
+    void *arg;
+    size_t reported;
+    pthread_mutex_t lock;
+    pthread_cond_t cond; // signalled whenever a job is done
+    size_t next __attribute__((aligned(CACHE_LINE)));
+} job_pool;
+
+/*
+ * function: mark job as done, report it right away when there is no reporting thread
+ */
+static void pool_done(job_pool *pool, sm3_file_job *job) {
+    if (pool->threads == 1) {
+        job->done = true;
+        while (pool->reported < pool->count && pool->jobs[pool->reported].done) {
+            pool->report(&pool->jobs[pool->reported++], pool->arg);
+        }
+        return;
+    }
+    pthread_mutex_lock(&pool->lock);
+    job->done = true;
+    pthread_cond_signal(&pool->cond);
+    pthread_mutex_unlock(&pool->lock);
+}
+
+/*
+ * return: the next job nobody works on yet, NULL when all are taken
+ * jobs answered by the digest cache are passed on to the reporting side right away
+ */
+static sm3_file_job *pool_take(job_pool *pool) {
+    size_t i;
+    while ((i = __atomic_fetch_add(&pool->next, 1, __ATOMIC_RELAXED)) < pool->count) {
+        if (!pool->jobs[i].cached) {
+            return &pool->jobs[i];
+        }
+        pool_done(pool, &pool->jobs[i]);
+    }
+    return NULL;
+}
+
+/*
+ * a lane of the multi-buffer scheduler, owns one open file at a time
+ * buf[pos, len) holds data read but not hashed yet
+ */
+typedef struct {
+    sm3_file_job *job; // NULL when the lane is idle
+    int fd;
+    sm3_ctx ctx;
+    uint8_t *buf;
+    const uint8_t *data; // either buf or a mapping of the whole file
+    size_t pos, len;
+    bool eof;
+    bool mapped;
+    bool regular;
+} mb_lane;
+
+// files smaller than this are read whole by a single read() instead of being mapped
+#define MB_LANE_BUF_SIZE (256 * SM3_BLOCK_BYTES)
+
+/*
+ * everything a worker writes while hashing, private to the worker
+ * and aligned so that no two workers share a cache line
+ */
+typedef struct {
+    job_pool *pool;
+    mb_lane lanes[SM3_MB_LANES];
+    uint32_t dummy_V[8];
+    pthread_t thread;
+} __attribute__((aligned(CACHE_LINE))) hash_worker;
+
+/*
+ * function: make sure the lane has at least one whole block buffered, or retire its file
+ * return: true if the lane still has a file to hash
+ */
+static bool mb_lane_refill(job_pool *pool, mb_lane *lane) {
+    while (lane->job != NULL) {
+        size_t left = lane->len - lane->pos;
+        if (left >= SM3_BLOCK_BYTES) {
+            return true;
+        }
+        if (!lane->eof) {
+            uint64_t start = sm3_args.stats ? stats_clock() : 0;
+            memmove(lane->buf, lane->data + lane->pos, left);
+            lane->pos = 0;
+            ssize_t got = read_fill(lane->fd, lane->buf + left, MB_LANE_BUF_SIZE - left, lane->regular, &lane->eof);
+            lane->len = left + (got > 0 ? got : 0);
+            if (sm3_args.stats) {
+                lane->job->stats.read_ns += stats_clock() - start;
+            }
+            if (got < 0) {
+                lane->eof = true;
+                lane->job->failed = true;
+            }
+            continue;
+        }
+        // the tail goes through the streaming api, which does the padding
+        sm3_update(&lane->ctx, lane->data + lane->pos, left);
+        input_final(&lane->ctx, lane->job->digest);
+        if (lane->mapped) {
+            munmap((void *)lane->data, lane->len);
+        }
+        close(lane->fd);
+        if (sm3_args.stats) {
+            // wall_ns held the start time so far
+            lane->job->stats.bytes = input_length(&lane->ctx);
+            lane->job->stats.wall_ns = stats_clock() - lane->job->stats.wall_ns;
+        }
+        pool_done(pool, lane->job);
+        lane->job = NULL;
+    }
+    return false;
+}
+
+/*
+ * function: take jobs from the pool and hash blocks of up to SM3_MB_LANES files at once
+ * with the multi-buffer kernel
+ */
+static void worker_run_mb(hash_worker *worker) {
+    job_pool *pool = worker->pool;
+    mb_lane *lanes = worker->lanes;
+    uint32_t *V[SM3_MB_LANES];
+    const uint8_t *data[SM3_MB_LANES];
+    bool pool_empty = false;
+
+    while (true) {
+        int active = 0;
+        size_t nblocks = SIZE_MAX;
+        for (int l = 0; l < SM3_MB_LANES; l++) {
+            mb_lane *lane = &lanes[l];
+            while (!mb_lane_refill(pool, lane) && !pool_empty) {
+                // idle lane, start the next file
+                sm3_file_job *job = pool_take(pool);
+                if (job == NULL) {
+                    pool_empty = true;
+                    break;
+                }
+                if (sm3_args.stats) {
+                    job->stats.wall_ns = stats_clock();
+                }
+                struct stat st;
+                lane->fd = open_input(job->file_name);
+                if (lane->fd < 0 || fstat(lane->fd, &st) != 0) {
+                    if (lane->fd >= 0) {
+                        close(lane->fd);
+                    }
+                    job->failed = true;
+                    pool_done(pool, job);
+                    continue;
+                }
+                if (S_ISREG(st.st_mode) && st.st_size >= SPARSE_MIN && file_has_hole(lane->fd, 0, st.st_size)) {
+                    // the holes of a sparse file are not read, which a lane could not skip
+                    job->failed = sparse_hash(lane->fd, 0, st.st_size, job->digest,
+                                              sm3_args.stats ? &job->stats : NULL) != 0;
+                    close(lane->fd);
+                    if (sm3_args.stats) {
+                        job->stats.wall_ns = stats_clock() - job->stats.wall_ns;
+                    }
+                    pool_done(pool, job);
+                    continue;
+                }
+                lane->job = job;
+                lane->pos = 0;
+                lane->eof = false;
+                lane->regular = S_ISREG(st.st_mode);
+                // small files cost less to read whole than to map and fault in
+                lane->data = lane->regular && st.st_size >= MB_LANE_BUF_SIZE ? map_file(lane->fd, &lane->len) : NULL;
+                lane->mapped = lane->eof = lane->data != NULL;
+                if (!lane->mapped) {
+                    lane->data = lane->buf;
+                    lane->len = 0;
+                }
+                input_init(&lane->ctx);
+            }
+            if (lane->job != NULL) {
+                size_t avail = (lane->len - lane->pos) / SM3_BLOCK_BYTES;
+                nblocks = avail < nblocks ? avail : nblocks;
+                ++active;
+            }
+        }
+        if (active == 0) {
+            break;
+        }
+
+        if (active < MB_MIN_LANES) {
+            // not enough files left to fill the vectors
+            for (int l = 0; l < SM3_MB_LANES; l++) {
+                mb_lane *lane = &lanes[l];
+                if (lane->job != NULL) {
+                    uint64_t start = sm3_args.stats ? stats_clock() : 0;
+                    size_t avail = (lane->len - lane->pos) / SM3_BLOCK_BYTES * SM3_BLOCK_BYTES;
+                    sm3_update(&lane->ctx, lane->data + lane->pos, avail);
+                    lane->pos += avail;
+                    if (sm3_args.stats) {
+                        lane->job->stats.hash_ns += stats_clock() - start;
+                    }
+                }
+            }
+            continue;
+        }
+        const uint8_t *filler = NULL;
+        for (int l = 0; l < SM3_MB_LANES; l++) {
+            if (lanes[l].job != NULL) {
+                V[l] = lanes[l].ctx.V;
+                data[l] = filler = lanes[l].data + lanes[l].pos;
+            }
+        }
+        for (int l = 0; l < SM3_MB_LANES; l++) {
+            if (lanes[l].job == NULL) {
+                // idle lanes hash some valid memory into a throwaway state
+                V[l] = worker->dummy_V;
+                data[l] = filler;
+            }
+        }
+        uint64_t start = sm3_args.stats ? stats_clock() : 0;
+        sm3_mb_iterate(V, data, nblocks);
+        // the lanes share the time of the kernel
+        uint64_t share = sm3_args.stats ? (stats_clock() - start) / active : 0;
+        for (int l = 0; l < SM3_MB_LANES; l++) {
+            mb_lane *lane = &lanes[l];
+            if (lane->job != NULL) {
+                // whole blocks went straight into V, ctx->buf is empty at this point
+                lane->pos += nblocks * SM3_BLOCK_BYTES;
+                lane->ctx.total_len += nblocks * SM3_BLOCK_BYTES;
+                lane->job->stats.hash_ns += share;
+            }
+        }
+    }
+}
+
+/*
+ * function: take jobs from the pool and hash them one after another
+ */
+static void worker_run_scalar(hash_worker *worker) {
+    job_pool *pool = worker->pool;
+    // the lanes are idle on this path, the buffer of the first one takes small files whole
+    uint8_t *small_buf = worker->lanes[0].buf;
+    sm3_file_job *job;
+    while ((job = pool_take(pool)) != NULL) {
+        sm3_io_stats *stats = sm3_args.stats ? &job->stats : NULL;
+        uint64_t start = stats != NULL ? stats_clock() : 0;
+        int fd = open_input(job->file_name);
+        struct stat st;
+        int small = 1;
+        if (fd < 0 || fstat(fd, &st) != 0) {
+            job->failed = true;
+        } else if (sm3_args.resume_interval != 0 && S_ISREG(st.st_mode)) {
+            job->failed = checkpoint_hash(job->file_name, fd, sm3_args.resume_interval, job->digest, stats) != 0;
+        } else if (!sm3_args.direct && S_ISREG(st.st_mode) && st.st_size < MB_LANE_BUF_SIZE &&
+                   (small = small_file_hash(fd, small_buf, MB_LANE_BUF_SIZE, job->digest, stats)) <= 0) {
+            // one read whatever --io says, there is nothing to overlap for a file this size
+            job->failed = small < 0;
+        } else {
+            FILE *fp = fdopen(fd, "r");
+            if (fp == NULL) {
+                job->failed = true;
+            } else {
+                job->failed = read_and_calc(fp, job->digest, stats) != 0;
+                fclose(fp);
+                fd = -1;
+            }
+        }
+        if (fd >= 0) {
+            close(fd);
+        }
+        if (stats != NULL) {
+            stats->wall_ns = stats_clock() - start;
+        }
+        pool_done(pool, job);
+    }
+}
+
+static void *worker_run(void *arg) {
+    hash_worker *worker = (hash_worker *)arg;
+    // lanes read with mmap or read(), other --io modes, --direct and --resume take the scalar path
+    if (sm3_mb_available() && sm3_args.io_mode == IO_MMAP && !sm3_args.direct && sm3_args.resume_interval == 0) {
+        worker_run_mb(worker);
+    } else {
+        worker_run_scalar(worker);
+    }
+    return NULL;
+}
+
+/*
+ * return: number of online cpus, the default number of workers
+ */
+int online_cpus() {
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+    return n > 0 ? (int)n : 1;
+}
+
+/*
+ * jobs: plain SM3 files to hash, count entries
+ * threads: number of workers, the calling thread reports while they hash
+ * report: called for every job, in the order of jobs, as soon as it and all jobs before it are done
+ * function: hash a list of files, with the multi-buffer kernel when the cpu supports it
+ */
+static void hash_files_pool(sm3_file_job *jobs, size_t count, int threads, sm3_job_report report, void *arg) {
+    job_pool *pool;
+    hash_worker *workers;
+    if (threads > (int)count) {
+        threads = (int)count;
+    }
+    if (threads < 1) {
+        threads = 1;
+    }
+    if (posix_memalign((void **)&pool, CACHE_LINE, sizeof(job_pool)) != 0 ||
+        posix_memalign((void **)&workers, CACHE_LINE, threads * sizeof(hash_worker)) != 0) {
+        fprintf(stderr, "sm3sum: out of memory\n");
+        exit(1);
+    }
+    memset(pool, 0, sizeof(job_pool));
+    memset(workers, 0, threads * sizeof(hash_worker));
+    pool->jobs = jobs;
+    pool->count = count;
+    pool->threads = threads;
+    pool->report = report;
+    pool->arg = arg;
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->cond, NULL);
+    for (int t = 0; t < threads; t++) {
+        workers[t].pool = pool;
+        for (int l = 0; l < SM3_MB_LANES; l++) {
+            if (posix_memalign((void **)&workers[t].lanes[l].buf, CACHE_LINE, MB_LANE_BUF_SIZE) != 0) {
+                fprintf(stderr, "sm3sum: out of memory\n");
+                exit(1);
+            }
+        }
+    }
+
+    if (threads == 1) {
+        worker_run(&workers[0]);
+    } else {
+        for (int t = 0; t < threads; t++) {
+            pthread_create(&workers[t].thread, NULL, worker_run, &workers[t]);
+        }
+        pthread_mutex_lock(&pool->lock);
+        while (pool->reported < count) {
+            sm3_file_job *job = &jobs[pool->reported];
+            if (!job->done) {
+                pthread_cond_wait(&pool->cond, &pool->lock);
+                continue;
+            }
+            // print without holding the lock, workers keep going meanwhile
+            pthread_mutex_unlock(&pool->lock);
+            report(job, arg);
+            pthread_mutex_lock(&pool->lock);
+            ++pool->reported;
+        }
+        pthread_mutex_unlock(&pool->lock);
+        for (int t = 0; t < threads; t++) {
+            pthread_join(workers[t].thread, NULL);
+        }
+    }
+
+    for (int t = 0; t < threads; t++) {
+        for (int l = 0; l < SM3_MB_LANES; l++) {
+            free(workers[t].lanes[l].buf);
+        }
+    }
+    pthread_mutex_destroy(&pool->lock);
+    pthread_cond_destroy(&pool->cond);
+    free(workers);
+    free(pool);
+}
+
+/*
+ * the report of the caller of hash_files(), with --stats every job is recorded before it
+ */
+typedef struct {
+    sm3_job_report report;
+    void *arg;
+} stats_forward;
+
+static void stats_report(sm3_file_job *job, void *arg) {
+    stats_forward *forward = (stats_forward *)arg;
+    stats_record(job->file_name, &job->stats, job->cached, job->failed);
+    forward->report(job, forward->arg);
+}
+
+/*
+ * jobs: files to hash, count entries
+ * threads: number of threads to use
+ * report: called for every job, in the order of jobs, as soon as it and all jobs before it are done
+ * function: hash a list of files, plain SM3 files are spread over the threads,
+ * the chunks of an SM3TREE file are spread over the threads;
+ * with --cache, files whose inode, size and timestamps are unchanged are not read at all
+ */
+void hash_files(sm3_file_job *jobs, size_t count, int threads, sm3_job_report report, void *arg) {
+    digest_cache *cache = NULL;
+    struct stat *before = NULL;
+    stats_forward forward = {report, arg};
+    if (sm3_args.stats) {
+        report = stats_report;
+        arg = &forward;
+    }
+    // the cache holds plain digests, MACs are always computed
+    if (sm3_args.cache_file != NULL && sm3_args.hmac_key == NULL && count > 0) {
+        cache = cache_open(sm3_args.cache_file);
+        before = (struct stat *)calloc(count, sizeof(struct stat));
+        if (cache == NULL || before == NULL) {
+            fprintf(stderr, "sm3sum: out of memory\n");
+            exit(1);
+        }
+        for (size_t i = 0; i < count; i++) {
+            // only regular files have stable identities worth remembering
+            if (stat(jobs[i].file_name, &before[i]) != 0 || !S_ISREG(before[i].st_mode)) {
+                before[i].st_mode = 0;
+            } else if (!sm3_args.refresh_cache) {
+                jobs[i].cached = cache_lookup(cache, &before[i], jobs[i].tree_chunk, jobs[i].digest);
+            }
+        }
+    }
+
+    size_t i = 0;
+    while (i < count) {
+        size_t run = i;
+        while (run < count && jobs[run].tree_chunk == 0) {
+            ++run;
+        }
+        if (run > i) {
+            hash_files_pool(jobs + i, run - i, threads, report, arg);
+            i = run;
+            continue;
+        }
+        if (!jobs[i].cached) {
+            uint64_t start = sm3_args.stats ? stats_clock() : 0;
+            int fd = open_input(jobs[i].file_name);
+            struct stat st;
+            jobs[i].failed = fd < 0 || tree_hash_fd(fd, jobs[i].tree_chunk, threads, jobs[i].digest) != 0;
+            if (sm3_args.stats && !jobs[i].failed && fstat(fd, &st) == 0) {
+                jobs[i].stats.bytes = st.st_size;
+                jobs[i].stats.wall_ns = stats_clock() - start;
+            }
+            if (fd >= 0) {
+                close(fd);
+            }
+        }
+        jobs[i].done = true;
+        report(&jobs[i], arg);
+        ++i;
+    }
+
+    if (cache != NULL) {
+        for (i = 0; i < count; i++) {
+            struct stat after;
+            if (!jobs[i].cached && !jobs[i].failed && before[i].st_mode != 0 && stat(jobs[i].file_name, &after) == 0) {
+                cache_store(cache, &before[i], &after, jobs[i].tree_chunk, jobs[i].digest);
+            }
+        }
+        if (cache_close(cache) != 0) {
+            fprintf(stderr, "sm3sum: cannot update digest cache %s\n", sm3_args.cache_file);
+        }
+        free(before);
+    }
+}
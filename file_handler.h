@@ -4,20 +4,43 @@
 #include <stdint.h>
 #include <string.h>
 #include "sm3.h"
+#include "stats.h"
 #include <stdio.h>
+#include <stdbool.h>
 typedef struct file_hash_pair{
     char *file_name;
-    uint32_t expected_sm3[8];
-    uint32_t calculated_sm3[8];
+    size_t tree_chunk; // 0 for plain SM3, chunk size of an SM3TREE digest otherwise
+    uint32_t expected_sm3[8]; // digest bytes in printed order
     struct file_hash_pair *next;
 } file_sm3_pair;
 
+/*
+ * one file to be hashed by hash_files()
+ */
+typedef struct {
+    const char *file_name;
+    size_t tree_chunk; // 0 for plain SM3, chunk size of an SM3TREE digest otherwise
+    uint8_t digest[SM3_DIGEST_SIZE];
+    bool failed; // cannot be opened or read
+    bool cached; // digest taken from the digest cache, nothing to hash
+    bool done;
+    sm3_io_stats stats; // filled with --stats only
+    void *priv; // owned by the caller of hash_files()
+} sm3_file_job;
+
+typedef void (*sm3_job_report)(sm3_file_job *job, void *arg);
+
 extern sm3_arguments sm3_args;
 extern file_sm3_pair hash_pair_head;
-void parse_checklist(char *buf, size_t bsize);
+void sm3_hex(const uint8_t *digest, char *hex);
+void digest_line(const char *tag, const uint8_t *digest, const char *file_name);
+void sm3_print(const uint8_t *digest, const char *file_name);
+int parse_checklist(char *buf, size_t bsize);
 void parse_checklist_init();
 void parse_filelist();
-size_t get_file_size(char *filename);
-void read_and_calc(FILE *fp, size_t file_size);
-void stdin_read_and_calc();
+int open_input(const char *path);
+int read_and_calc(FILE *fp, uint8_t *digest, sm3_io_stats *stats);
+int stdin_read_and_calc(uint8_t *digest, sm3_io_stats *stats);
+int online_cpus();
+void hash_files(sm3_file_job *jobs, size_t count, int threads, sm3_job_report report, void *arg);
 #endif // FILE_HANDLER_H
\ No newline at end of file
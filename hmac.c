@@ -0,0 +1,195 @@
+#include "hmac.h"
+#include "sm3.h"
+#include "sm3_mb.h"
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include <string.h>
+
+/*
+ * HMAC-SM3 (GB/T 15852.2, RFC 2104 with SM3) and the KDF of GM/T 0003.
+ * HMAC(K, m) = SM3((K0 ^ opad) || SM3((K0 ^ ipad) || m)), K0 being K padded (or first hashed)
+ * to one block. Both keyed blocks are compressed once in sm3_hmac_key_init(), so a MAC costs
+ * the blocks of m, the inner padding and one outer block.
+ */
+
+#define HMAC_IPAD 0x36
+#define HMAC_OPAD 0x5c
+
+static const uint32_t sm3_iv[8] = {IV0, IV1, IV2, IV3, IV4, IV5, IV6, IV7};
+
+/*
+ * function: clear key material in a way the compiler cannot drop
+ */
+static void wipe(void *buf, size_t len) {
+    volatile uint8_t *p = (volatile uint8_t *)buf;
+    while (len-- > 0) {
+        *p++ = 0;
+    }
+}
+
+/*
+ * secret: the key, any length, longer keys are hashed first
+ * len: key size in bytes
+ * function: precompute the inner and outer midstates of the key
+ */
+void sm3_hmac_key_init(sm3_hmac_key *key, const void *secret, size_t len) {
+    uint8_t block[SM3_BLOCK_BYTES], pad[SM3_BLOCK_BYTES];
+    memset(block, 0, sizeof(block));
+    if (len > SM3_BLOCK_BYTES) {
+        sm3(secret, len, block);
+    } else {
+        memcpy(block, secret, len);
+    }
+    for (int i = 0; i < SM3_BLOCK_BYTES; i++) {
+        pad[i] = block[i] ^ HMAC_IPAD;
+    }
+    memcpy(key->inner, sm3_iv, sizeof(sm3_iv));
+    sm3_iterate(key->inner, pad, 1);
+    for (int i = 0; i < SM3_BLOCK_BYTES; i++) {
+        pad[i] = block[i] ^ HMAC_OPAD;
+    }
+    memcpy(key->outer, sm3_iv, sizeof(sm3_iv));
+    sm3_iterate(key->outer, pad, 1);
+    wipe(block, sizeof(block));
+    wipe(pad, sizeof(pad));
+}
+
+/*
+ * function: set ctx to the inner midstate, as if the inner key block had been hashed
+ */
+void sm3_hmac_start(sm3_ctx *ctx, const sm3_hmac_key *key) {
+    memcpy(ctx->V, key->inner, sizeof(ctx->V));
+    ctx->buf_len = 0;
+    ctx->total_len = SM3_BLOCK_BYTES;
+}
+
+/*
+ * function: the one block after the outer midstate, inner digest plus padding of a
+ * two block message
+ */
+static void outer_block(uint8_t *block, const uint8_t *inner) {
+    uint64_t bit_len_be = local_to_be((uint64_t)(SM3_BLOCK_BYTES + SM3_DIGEST_SIZE) * BYTE_SIZE);
+    memcpy(block, inner, SM3_DIGEST_SIZE);
+    block[SM3_DIGEST_SIZE] = 0x80;
+    memset(block + SM3_DIGEST_SIZE + 1, 0, SM3_BLOCK_BYTES - SM3_DIGEST_SIZE - 1 - sizeof(uint64_t));
+    memcpy(block + SM3_BLOCK_BYTES - sizeof(uint64_t), &bit_len_be, sizeof(uint64_t));
+}
+
+static void store_digest(uint8_t *digest, const uint32_t *V) {
+    for (int i = 0; i < 8; i++) {
+        uint32_t word = local_to_be32(V[i]);
+        memcpy(digest + i * WORDSIZE, &word, WORDSIZE);
+    }
+}
+
+/*
+ * ctx: inner hash started by sm3_hmac_start(), must be re-initialized before reuse
+ * outer: the outer midstate of the key
+ * mac: at least SM3_DIGEST_SIZE bytes, may be anywhere
+ * function: finish the inner hash and run the outer block
+ */
+void sm3_hmac_finish(sm3_ctx *ctx, const uint32_t *outer, uint8_t *mac) {
+    uint8_t inner[SM3_DIGEST_SIZE], block[SM3_BLOCK_BYTES];
+    uint32_t V[8];
+    sm3_final(ctx, inner);
+    outer_block(block, inner);
+    memcpy(V, outer, sizeof(V));
+    sm3_iterate(V, block, 1);
+    store_digest(mac, V);
+}
+
+void sm3_hmac_init(sm3_hmac_ctx *ctx, const sm3_hmac_key *key) {
+    sm3_hmac_start(&ctx->ctx, key);
+    memcpy(ctx->outer, key->outer, sizeof(ctx->outer));
+}
+
+void sm3_hmac_update(sm3_hmac_ctx *ctx, const void *data, size_t len) {
+    sm3_update(&ctx->ctx, data, len);
+}
+
+/*
+ * mac: at least SM3_DIGEST_SIZE bytes, receives the HMAC-SM3 value
+ */
+void sm3_hmac_final(sm3_hmac_ctx *ctx, uint8_t *mac) {
+    sm3_hmac_finish(&ctx->ctx, ctx->outer, mac);
+}
+
+/*
+ * function: one-shot HMAC-SM3 of a buffer
+ */
+void sm3_hmac(const sm3_hmac_key *key, const void *data, size_t len, uint8_t *mac) {
+    sm3_ctx ctx;
+    sm3_hmac_start(&ctx, key);
+    sm3_update(&ctx, data, len);
+    sm3_hmac_finish(&ctx, key->outer, mac);
+}
+
+/*
+ * key: shared by all messages
+ * data: count messages
+ * len: size in bytes of each message
+ * macs: count * SM3_DIGEST_SIZE bytes, receives the MACs in the order of data
+ * function: the inner hashes go through sm3_batch_ctx() from the inner midstate, then the
+ * outer blocks of up to SM3_MB_LANES messages are compressed together
+ */
+void sm3_hmac_batch(const sm3_hmac_key *key, const void *const *data, const size_t *len, size_t count,
+                    uint8_t *macs) {
+    sm3_ctx start;
+    uint8_t blocks[SM3_MB_LANES][SM3_BLOCK_BYTES];
+    uint32_t V[SM3_MB_LANES][8];
+    uint32_t *mb_V[SM3_MB_LANES];
+    const uint8_t *mb_buf[SM3_MB_LANES];
+    sm3_hmac_start(&start, key);
+    sm3_batch_ctx(&start, data, len, count, macs);
+    bool mb = sm3_mb_available();
+
+    for (size_t i = 0; i < count; i += SM3_MB_LANES) {
+        int n = count - i < SM3_MB_LANES ? (int)(count - i) : SM3_MB_LANES;
+        for (int l = 0; l < SM3_MB_LANES; l++) {
+            // idle lanes repeat the first message into their own state
+            outer_block(blocks[l], macs + (i + (l < n ? l : 0)) * SM3_DIGEST_SIZE);
+            memcpy(V[l], key->outer, sizeof(V[l]));
+            mb_V[l] = V[l];
+            mb_buf[l] = blocks[l];
+        }
+        if (mb && n >= MB_MIN_LANES) {
+            sm3_mb_iterate(mb_V, mb_buf, 1);
+        } else {
+            for (int l = 0; l < n; l++) {
+                sm3_iterate(V[l], blocks[l], 1);
+            }
+        }
+        for (int l = 0; l < n; l++) {
+            store_digest(macs + (i + l) * SM3_DIGEST_SIZE, V[l]);
+        }
+    }
+}
+
+/*
+ * z: shared secret
+ * zlen: its size in bytes
+ * out: receives outlen bytes of key material
+ * function: the KDF of GM/T 0003, SM3(Z || ct) for ct = 1, 2, ... as 32-bit big endian
+ * counters, concatenated and cut to outlen; Z is hashed once and every block of output
+ * continues from that midstate
+ */
+void sm3_kdf(const void *z, size_t zlen, uint8_t *out, size_t outlen) {
+    sm3_ctx base, ctx;
+    uint8_t digest[SM3_DIGEST_SIZE];
+    sm3_init(&base);
+    sm3_update(&base, z, zlen);
+    for (uint32_t ct = 1; outlen > 0; ct++) {
+        uint32_t ct_be = local_to_be32(ct);
+        size_t len = outlen < SM3_DIGEST_SIZE ? outlen : SM3_DIGEST_SIZE;
+        ctx = base;
+        sm3_update(&ctx, &ct_be, sizeof(ct_be));
+        sm3_final(&ctx, digest);
+        memcpy(out, digest, len);
+        out += len;
+        outlen -= len;
+    }
+    wipe(&base, sizeof(base));
+    wipe(&ctx, sizeof(ctx));
+    wipe(digest, sizeof(digest));
+}
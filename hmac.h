@@ -0,0 +1,15 @@
+#ifndef HMAC_H
+#define HMAC_H
+#include <stddef.h>
+#include <stdint.h>
+#include "libsm3.h"
+/*
+ * This header contains declearations of the HMAC-SM3 internals that the
+ * file paths use to key a plain sm3_ctx, see libsm3.h for the public api
+ */
+#define HMAC_TAG "HMAC-SM3"
+
+void sm3_hmac_start(sm3_ctx *ctx, const sm3_hmac_key *key);
+void sm3_hmac_finish(sm3_ctx *ctx, const uint32_t *outer, uint8_t *mac);
+
+#endif // HMAC_H
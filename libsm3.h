@@ -0,0 +1,69 @@
+#ifndef LIBSM3_H
+#define LIBSM3_H
+#include <stddef.h>
+#include <stdint.h>
+/*
+ * This header contains declearations of the public api of libsm3, the SM3
+ * hash of GM/T 0004-2012 as a library. Everything not declared here is
+ * internal to the library and not exported from libsm3.so.
+ */
+#define SM3_VERSION_MAJOR 1
+#define SM3_VERSION_MINOR 1
+#define SM3_VERSION_PATCH 0
+#define SM3_VERSION "1.1.0"
+
+#define SM3_API __attribute__((visibility("default")))
+
+#define SM3_BLOCK_BYTES 64
+#define SM3_DIGEST_SIZE 32
+
+/*
+ * streaming hash context, one per message being hashed, its layout is part
+ * of the abi of a major version
+ * V: chaining value (in local endian)
+ * buf: pending bytes that do not fill a whole block yet
+ * buf_len: number of valid bytes in buf
+ * total_len: message length in bytes seen so far
+ */
+typedef struct {
+    uint32_t V[8];
+    uint8_t buf[SM3_BLOCK_BYTES];
+    size_t buf_len;
+    uint64_t total_len;
+} sm3_ctx;
+
+SM3_API const char *sm3_version();
+SM3_API void sm3_init(sm3_ctx *ctx);
+SM3_API void sm3_update(sm3_ctx *ctx, const void *data, size_t len);
+SM3_API void sm3_final(sm3_ctx *ctx, uint8_t *digest);
+SM3_API void sm3(const void *data, size_t len, uint8_t *digest);
+SM3_API void sm3_batch(const void *const *data, const size_t *len, size_t count, uint8_t *digests);
+
+/*
+ * HMAC-SM3 key, the chaining values after the inner (key ^ ipad) and the outer
+ * (key ^ opad) block, computed once by sm3_hmac_key_init() and shared read-only
+ * by any number of threads; it is as secret as the key itself
+ */
+typedef struct {
+    uint32_t inner[8];
+    uint32_t outer[8];
+} sm3_hmac_key;
+
+/*
+ * streaming HMAC-SM3 context, one per message
+ */
+typedef struct {
+    sm3_ctx ctx; // inner hash, continued from the inner midstate
+    uint32_t outer[8];
+} sm3_hmac_ctx;
+
+SM3_API void sm3_hmac_key_init(sm3_hmac_key *key, const void *secret, size_t len);
+SM3_API void sm3_hmac_init(sm3_hmac_ctx *ctx, const sm3_hmac_key *key);
+SM3_API void sm3_hmac_update(sm3_hmac_ctx *ctx, const void *data, size_t len);
+SM3_API void sm3_hmac_final(sm3_hmac_ctx *ctx, uint8_t *mac);
+SM3_API void sm3_hmac(const sm3_hmac_key *key, const void *data, size_t len, uint8_t *mac);
+SM3_API void sm3_hmac_batch(const sm3_hmac_key *key, const void *const *data, const size_t *len, size_t count,
+                            uint8_t *macs);
+SM3_API void sm3_kdf(const void *z, size_t zlen, uint8_t *out, size_t outlen);
+
+#endif // LIBSM3_H
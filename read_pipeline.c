@@ -0,0 +1,414 @@
+#define _GNU_SOURCE // O_DIRECT
+#include "read_pipeline.h"
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#ifdef __linux__
+#include <linux/io_uring.h>
+#endif
+
+/*
+ * Buffers are filled in file order and handed to the caller in the same order.
+ * The buffer returned by pipeline_next() stays valid until the next call, which
+ * gives it back to the reader.
+ *
+ * Two backends:
+ * io_uring: files that can be read at an offset get PIPELINE_DEPTH reads queued
+ *           in the kernel at once, no extra thread involved
+ * thread:   a reader thread fills the buffers with read(2), used for pipes, or
+ *           when io_uring is not available (old kernel, seccomp, not Linux)
+ *
+ * Buffers are PIPELINE_ALIGN aligned and every read but the one at the end of the
+ * file starts at a multiple of PIPELINE_BUF_SIZE, so fd may be opened with O_DIRECT.
+ * When a read is refused for its alignment (the unaligned tail of a file), O_DIRECT
+ * is dropped and the read is tried again through the page cache.
+ */
+
+#define PIPE_SIZE (1 << 20) // capacity asked for a pipe being read
+
+typedef struct {
+    uint8_t *buf;
+    size_t len; // bytes filled
+    uint64_t offset; // io_uring: file offset of buf[0]
+    struct iovec iov; // io_uring: the part of buf still to be filled
+    bool ready;
+    bool eof; // the file ends within this buffer
+    bool failed;
+} pipeline_slot;
+
+#ifdef __NR_io_uring_setup
+typedef struct {
+    int fd;
+    unsigned *sq_tail, *sq_mask, *sq_array;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    void *sq_ptr, *cq_ptr;
+    size_t sq_size, cq_size, sqes_size;
+} uring;
+#endif
+
+struct read_pipeline {
+    int fd;
+    pipeline_slot slots[PIPELINE_DEPTH];
+    size_t cur; // slot handed to the caller next
+    bool returned; // the caller holds slots[cur - 1]
+    bool use_uring;
+    uint64_t next_offset; // io_uring: offset of the next read to queue
+#ifdef __NR_io_uring_setup
+    uring ring;
+#endif
+    // reader thread backend
+    pthread_t reader;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    bool stop;
+};
+
+#ifdef __NR_io_uring_setup
+
+/*
+ * return: 0 on success, -1 if the kernel refuses to set up a ring
+ */
+static int uring_setup(uring *ring, unsigned entries) {
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    ring->fd = syscall(__NR_io_uring_setup, entries, &params);
+    if (ring->fd < 0) {
+        return -1;
+    }
+    ring->sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    ring->cq_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        ring->sq_size = ring->cq_size = ring->sq_size > ring->cq_size ? ring->sq_size : ring->cq_size;
+    }
+    ring->sq_ptr = mmap(NULL, ring->sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+    if (ring->sq_ptr == MAP_FAILED) {
+        close(ring->fd);
+        return -1;
+    }
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        ring->cq_ptr = ring->sq_ptr;
+    } else {
+        ring->cq_ptr = mmap(NULL, ring->cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+        if (ring->cq_ptr == MAP_FAILED) {
+            munmap(ring->sq_ptr, ring->sq_size);
+            close(ring->fd);
+            return -1;
+        }
+    }
+    ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+    if (ring->sqes == MAP_FAILED) {
+        if (ring->cq_ptr != ring->sq_ptr) {
+            munmap(ring->cq_ptr, ring->cq_size);
+        }
+        munmap(ring->sq_ptr, ring->sq_size);
+        close(ring->fd);
+        return -1;
+    }
+    ring->sq_tail = (unsigned *)((char *)ring->sq_ptr + params.sq_off.tail);
+    ring->sq_mask = (unsigned *)((char *)ring->sq_ptr + params.sq_off.ring_mask);
+    ring->sq_array = (unsigned *)((char *)ring->sq_ptr + params.sq_off.array);
+    ring->cq_head = (unsigned *)((char *)ring->cq_ptr + params.cq_off.head);
+    ring->cq_tail = (unsigned *)((char *)ring->cq_ptr + params.cq_off.tail);
+    ring->cq_mask = (unsigned *)((char *)ring->cq_ptr + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *)((char *)ring->cq_ptr + params.cq_off.cqes);
+    return 0;
+}
+
+static void uring_teardown(uring *ring) {
+    munmap(ring->sqes, ring->sqes_size);
+    if (ring->cq_ptr != ring->sq_ptr) {
+        munmap(ring->cq_ptr, ring->cq_size);
+    }
+    munmap(ring->sq_ptr, ring->sq_size);
+    close(ring->fd);
+}
+
+/*
+ * function: queue a read of the unfilled part of slot i and submit it
+ * return: 0 on success, -1 if the kernel did not take it
+ */
+static int uring_queue(read_pipeline *pipe, size_t i) {
+    uring *ring = &pipe->ring;
+    pipeline_slot *slot = &pipe->slots[i];
+    unsigned tail = *ring->sq_tail;
+    unsigned idx = tail & *ring->sq_mask;
+    struct io_uring_sqe *sqe = &ring->sqes[idx];
+    memset(sqe, 0, sizeof(*sqe));
+    // READV rather than READ, it is there since the first io_uring kernel
+    slot->iov.iov_base = slot->buf + slot->len;
+    slot->iov.iov_len = PIPELINE_BUF_SIZE - slot->len;
+    sqe->opcode = IORING_OP_READV;
+    sqe->fd = pipe->fd;
+    sqe->addr = (uint64_t)(uintptr_t)&slot->iov;
+    sqe->len = 1;
+    sqe->off = slot->offset + slot->len;
+    sqe->user_data = i;
+    ring->sq_array[idx] = idx;
+    __atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    while (syscall(__NR_io_uring_enter, ring->fd, 1, 0, 0, NULL, 0) < 0) {
+        if (errno != EINTR) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/*
+ * function: wait for at least one completion and account every completion available
+ * return: 0 on success, -1 on a ring error
+ */
+static int uring_reap(read_pipeline *pipe) {
+    uring *ring = &pipe->ring;
+    while (syscall(__NR_io_uring_enter, ring->fd, 0, 1, IORING_ENTER_GETEVENTS, NULL, 0) < 0) {
+        if (errno != EINTR) {
+            return -1;
+        }
+    }
+    unsigned head = *ring->cq_head;
+    while (head != __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE)) {
+        struct io_uring_cqe *cqe = &ring->cqes[head & *ring->cq_mask];
+        pipeline_slot *slot = &pipe->slots[cqe->user_data];
+        if (cqe->res == -EINVAL && set_direct_io(pipe->fd, false)) {
+            if (uring_queue(pipe, cqe->user_data) != 0) {
+                slot->failed = slot->ready = true;
+            }
+        } else if (cqe->res < 0) {
+            slot->failed = slot->ready = true;
+        } else if (cqe->res == 0) {
+            slot->eof = slot->ready = true;
+        } else {
+            slot->len += cqe->res;
+            if (slot->len == PIPELINE_BUF_SIZE) {
+                slot->ready = true;
+            } else if (uring_queue(pipe, cqe->user_data) != 0) {
+                // short read, ask again for the rest so that buffers stay contiguous
+                slot->failed = slot->ready = true;
+            }
+        }
+        ++head;
+    }
+    __atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+    return 0;
+}
+
+#endif // __NR_io_uring_setup
+
+/*
+ * function: the reader thread, fills free slots in order until end of file
+ */
+static void *pipeline_reader(void *arg) {
+    read_pipeline *pipe = (read_pipeline *)arg;
+    for (size_t i = 0; ; i = (i + 1) % PIPELINE_DEPTH) {
+        pipeline_slot *slot = &pipe->slots[i];
+        bool stop;
+        pthread_mutex_lock(&pipe->lock);
+        while (slot->ready && !pipe->stop) {
+            pthread_cond_wait(&pipe->cond, &pipe->lock);
+        }
+        stop = pipe->stop;
+        pthread_mutex_unlock(&pipe->lock);
+        if (stop) {
+            break;
+        }
+        size_t len = 0;
+        bool eof = false, failed = false;
+        while (len < PIPELINE_BUF_SIZE) {
+            ssize_t got = read(pipe->fd, slot->buf + len, PIPELINE_BUF_SIZE - len);
+            if (got < 0 && (errno == EINTR || (errno == EINVAL && set_direct_io(pipe->fd, false)))) {
+                continue;
+            }
+            if (got <= 0) {
+                eof = got == 0;
+                failed = got < 0;
+                break;
+            }
+            len += got;
+        }
+        pthread_mutex_lock(&pipe->lock);
+        slot->len = len;
+        slot->eof = eof;
+        slot->failed = failed;
+        slot->ready = true;
+        pthread_cond_broadcast(&pipe->cond);
+        pthread_mutex_unlock(&pipe->lock);
+        if (eof || failed) {
+            break;
+        }
+    }
+    return NULL;
+}
+
+/*
+ * fd: file to read from its current offset, it is not closed by the pipeline
+ * allow_uring: use io_uring if fd can be read at an offset and the kernel supports it
+ * return: the pipeline, NULL if out of memory
+ */
+read_pipeline *pipeline_open(int fd, bool allow_uring) {
+    read_pipeline *pipe = (read_pipeline *)calloc(1, sizeof(read_pipeline));
+    if (pipe == NULL) {
+        return NULL;
+    }
+    pipe->fd = fd;
+    for (int i = 0; i < PIPELINE_DEPTH; i++) {
+        if (posix_memalign((void **)&pipe->slots[i].buf, PIPELINE_ALIGN, PIPELINE_BUF_SIZE) != 0) {
+            while (i-- > 0) {
+                free(pipe->slots[i].buf);
+            }
+            free(pipe);
+            return NULL;
+        }
+    }
+
+#ifdef __NR_io_uring_setup
+    off_t start = lseek(fd, 0, SEEK_CUR);
+    if (allow_uring && start >= 0 && uring_setup(&pipe->ring, PIPELINE_DEPTH) == 0) {
+        pipe->use_uring = true;
+        pipe->next_offset = start;
+        for (size_t i = 0; i < PIPELINE_DEPTH; i++) {
+            pipe->slots[i].offset = pipe->next_offset;
+            pipe->next_offset += PIPELINE_BUF_SIZE;
+            if (uring_queue(pipe, i) == 0) {
+                continue;
+            }
+            if (i > 0) {
+                pipe->slots[i].failed = pipe->slots[i].ready = true;
+                continue;
+            }
+            // the ring exists but does not take reads, nothing is in flight yet
+            uring_teardown(&pipe->ring);
+            pipe->use_uring = false;
+            break;
+        }
+        if (pipe->use_uring) {
+            return pipe;
+        }
+    }
+#endif
+#ifdef F_SETPIPE_SZ
+    struct stat st;
+    if (fstat(fd, &st) == 0 && S_ISFIFO(st.st_mode)) {
+        // a bigger pipe lets the writer run ahead and wakes the reader less often,
+        // unprivileged users get up to /proc/sys/fs/pipe-max-size (1 MiB by default)
+        fcntl(fd, F_SETPIPE_SZ, PIPE_SIZE);
+    }
+#endif
+    pthread_mutex_init(&pipe->lock, NULL);
+    pthread_cond_init(&pipe->cond, NULL);
+    pthread_create(&pipe->reader, NULL, pipeline_reader, pipe);
+    return pipe;
+}
+
+/*
+ * len: receives the number of bytes in the returned buffer, 0 at end of file
+ * return: the next piece of the file, NULL on a read error
+ */
+const uint8_t *pipeline_next(read_pipeline *pipe, size_t *len) {
+    size_t prev = (pipe->cur + PIPELINE_DEPTH - 1) % PIPELINE_DEPTH;
+    pipeline_slot *slot = &pipe->slots[pipe->cur];
+
+    if (pipe->use_uring) {
+#ifdef __NR_io_uring_setup
+        if (pipe->returned) {
+            pipeline_slot *old = &pipe->slots[prev];
+            if (old->eof || old->failed) {
+                // nothing after the end is worth reading, keep reporting it
+                *len = 0;
+                return old->failed ? NULL : old->buf;
+            }
+            old->len = 0;
+            old->ready = false;
+            old->offset = pipe->next_offset;
+            pipe->next_offset += PIPELINE_BUF_SIZE;
+            if (uring_queue(pipe, prev) != 0) {
+                old->failed = old->ready = true;
+            }
+        }
+        while (!slot->ready) {
+            if (uring_reap(pipe) != 0) {
+                return NULL;
+            }
+        }
+#endif
+    } else {
+        pthread_mutex_lock(&pipe->lock);
+        if (pipe->returned) {
+            pipeline_slot *old = &pipe->slots[prev];
+            if (old->eof || old->failed) {
+                pthread_mutex_unlock(&pipe->lock);
+                *len = 0;
+                return old->failed ? NULL : old->buf;
+            }
+            old->ready = false;
+            pthread_cond_broadcast(&pipe->cond);
+        }
+        while (!slot->ready) {
+            pthread_cond_wait(&pipe->cond, &pipe->lock);
+        }
+        pthread_mutex_unlock(&pipe->lock);
+    }
+
+    pipe->returned = true;
+    pipe->cur = (pipe->cur + 1) % PIPELINE_DEPTH;
+    *len = slot->len;
+    return slot->failed ? NULL : slot->buf;
+}
+
+/*
+ * fd: an open file
+ * on: whether reads of fd should bypass the page cache
+ * return: true if the O_DIRECT flag of fd was changed, false if it already was as
+ * asked or the file system does not support direct io
+ */
+bool set_direct_io(int fd, bool on) {
+#ifdef O_DIRECT
+    int flags = fcntl(fd, F_GETFL);
+    if (flags < 0 || (bool)(flags & O_DIRECT) == on) {
+        return false;
+    }
+    return fcntl(fd, F_SETFL, on ? flags | O_DIRECT : flags & ~O_DIRECT) == 0;
+#else
+    return false;
+#endif
+}
+
+void pipeline_close(read_pipeline *pipe) {
+    if (pipe->use_uring) {
+#ifdef __NR_io_uring_setup
+        // reads still in flight write into the buffers, let them land first
+        for (size_t i = 0; i < PIPELINE_DEPTH; i++) {
+            while (!pipe->slots[i].ready) {
+                if (uring_reap(pipe) != 0) {
+                    break;
+                }
+            }
+        }
+        uring_teardown(&pipe->ring);
+#endif
+    } else {
+        pthread_mutex_lock(&pipe->lock);
+        pipe->stop = true;
+        pthread_cond_broadcast(&pipe->cond);
+        pthread_mutex_unlock(&pipe->lock);
+        pthread_join(pipe->reader, NULL);
+        pthread_mutex_destroy(&pipe->lock);
+        pthread_cond_destroy(&pipe->cond);
+    }
+    for (int i = 0; i < PIPELINE_DEPTH; i++) {
+        free(pipe->slots[i].buf);
+    }
+    free(pipe);
+}
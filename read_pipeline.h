@@ -0,0 +1,22 @@
+#ifndef READ_PIPELINE_H
+#define READ_PIPELINE_H
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+/*
+ * This header contains declearations of the read pipeline, which keeps
+ * several buffers of a file in flight while the caller hashes the ones
+ * already filled
+ */
+#define PIPELINE_DEPTH 4
+#define PIPELINE_BUF_SIZE (2 << 20)
+#define PIPELINE_ALIGN 4096
+
+typedef struct read_pipeline read_pipeline;
+
+read_pipeline *pipeline_open(int fd, bool allow_uring);
+const uint8_t *pipeline_next(read_pipeline *pipe, size_t *len);
+void pipeline_close(read_pipeline *pipe);
+bool set_direct_io(int fd, bool on);
+
+#endif // READ_PIPELINE_H
@@ -0,0 +1,339 @@
+#define _GNU_SOURCE // accept4
+#include "serve.h"
+#include "sm3.h"
+#include "file_handler.h"
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <signal.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+/*
+ * A connection carries any number of batches, one after another:
+ *   request  = be32 count || count * (kind || be32 length || length bytes)
+ *   response = count * (status || 32 byte digest)
+ * kind is SERVE_PATH or SERVE_DATA, status is 0 when the digest is valid and 1 when the file
+ * could not be read or its path is not absolute (the digest is then all zeros). count is at most SERVE_BATCH_MAX and the
+ * lengths add up to at most SERVE_BATCH_BYTES; a malformed batch closes the connection, and so
+ * does the client once it is done. Digests are always plain SM3 and nothing in a response says
+ * otherwise, so serve_conflict() refuses --hmac-key-file on both sides.
+ *
+ * Every connection has a thread of its own. The files of a batch go through hash_files(), which
+ * hashes them with -j workers; batches of different connections take the workers in turn, which
+ * also keeps the digest cache to one user at a time. Inline data is hashed by the thread of the
+ * connection with the multi-buffer batch api.
+ */
+
+#define SERVE_RESPONSE_SIZE (1 + SM3_DIGEST_SIZE)
+
+static pthread_mutex_t hash_lock = PTHREAD_MUTEX_INITIALIZER;
+static const char *listen_path; // unlinked when the server is stopped
+
+/*
+ * return: 0 once len bytes are read, -1 on end of file or error
+ */
+static int read_full(int fd, void *buf, size_t len) {
+    for (size_t got = 0; got < len;) {
+        ssize_t n = read(fd, (uint8_t *)buf + got, len - got);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return -1;
+        }
+        got += n;
+    }
+    return 0;
+}
+
+/*
+ * return: 0 once len bytes are written, -1 on error
+ */
+static int write_full(int fd, const void *buf, size_t len) {
+    for (size_t done = 0; done < len;) {
+        ssize_t n = write(fd, (const uint8_t *)buf + done, len - done);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n < 0) {
+            return -1;
+        }
+        done += n;
+    }
+    return 0;
+}
+
+static int read_be32(int fd, uint32_t *value) {
+    uint8_t b[4];
+    if (read_full(fd, b, sizeof(b)) != 0) {
+        return -1;
+    }
+    *value = (uint32_t)b[0] << 24 | (uint32_t)b[1] << 16 | (uint32_t)b[2] << 8 | b[3];
+    return 0;
+}
+
+static uint8_t *put_be32(uint8_t *p, uint32_t value) {
+    p[0] = value >> 24;
+    p[1] = value >> 16;
+    p[2] = value >> 8;
+    p[3] = value;
+    return p + 4;
+}
+
+static void no_report(sm3_file_job *job, void *arg) {
+    (void)job;
+    (void)arg;
+}
+
+/*
+ * fd: connected socket, closed by the caller
+ * return: 0 when the batch is answered, -1 at the end of the connection or on a malformed batch
+ */
+static int serve_batch(int fd) {
+    uint32_t count;
+    if (read_be32(fd, &count) != 0 || count > SERVE_BATCH_MAX) {
+        return -1;
+    }
+    char *kinds = (char *)calloc(count + 1, 1);
+    uint8_t **items = (uint8_t **)calloc(count + 1, sizeof(uint8_t *));
+    size_t *lens = (size_t *)calloc(count + 1, sizeof(size_t));
+    sm3_file_job *jobs = (sm3_file_job *)calloc(count + 1, sizeof(sm3_file_job));
+    const void **data = (const void **)calloc(count + 1, sizeof(void *));
+    size_t *data_lens = (size_t *)calloc(count + 1, sizeof(size_t));
+    uint8_t *digests = (uint8_t *)calloc(count + 1, SM3_DIGEST_SIZE);
+    uint8_t *response = (uint8_t *)calloc(count + 1, SERVE_RESPONSE_SIZE);
+    if (kinds == NULL || items == NULL || lens == NULL || jobs == NULL || data == NULL || data_lens == NULL ||
+        digests == NULL || response == NULL) {
+        fprintf(stderr, "sm3sum: out of memory\n");
+        exit(1);
+    }
+    int ret = 0;
+    size_t njobs = 0, ndata = 0, bytes = 0;
+    for (uint32_t i = 0; i < count && ret == 0; i++) {
+        uint32_t len;
+        if (read_full(fd, &kinds[i], 1) != 0 || (kinds[i] != SERVE_PATH && kinds[i] != SERVE_DATA) ||
+            read_be32(fd, &len) != 0 || len > SERVE_BATCH_BYTES - bytes) {
+            ret = -1;
+            break;
+        }
+        // paths are NUL terminated for hash_files()
+        items[i] = (uint8_t *)malloc(len + 1);
+        if (items[i] == NULL || read_full(fd, items[i], len) != 0) {
+            ret = -1;
+            break;
+        }
+        items[i][len] = 0;
+        lens[i] = len;
+        bytes += len;
+    }
+    for (uint32_t i = 0; i < count && ret == 0; i++) {
+        if (kinds[i] == SERVE_DATA) {
+            data[ndata] = items[i];
+            data_lens[ndata++] = lens[i];
+        } else if (lens[i] > 0 && items[i][0] == '/' && memchr(items[i], 0, lens[i]) == NULL) {
+            // a relative path would name whatever the working directory of the server holds
+            jobs[njobs++].file_name = (const char *)items[i];
+        }
+    }
+    if (ret == 0) {
+        sm3_batch(data, data_lens, ndata, digests);
+        pthread_mutex_lock(&hash_lock);
+        hash_files(jobs, njobs, sm3_args.jobs, no_report, NULL);
+        pthread_mutex_unlock(&hash_lock);
+
+        // answers go back in the order of the requests
+        size_t j = 0, d = 0;
+        for (uint32_t i = 0; i < count; i++) {
+            uint8_t *r = response + i * SERVE_RESPONSE_SIZE;
+            if (kinds[i] == SERVE_DATA) {
+                memcpy(r + 1, digests + d++ * SM3_DIGEST_SIZE, SM3_DIGEST_SIZE);
+            } else if (j < njobs && jobs[j].file_name == (const char *)items[i]) {
+                r[0] = jobs[j].failed;
+                if (!jobs[j].failed) {
+                    memcpy(r + 1, jobs[j].digest, SM3_DIGEST_SIZE);
+                }
+                ++j;
+            } else {
+                // a relative path, or one holding a NUL
+                r[0] = 1;
+            }
+        }
+        ret = write_full(fd, response, count * SERVE_RESPONSE_SIZE);
+    }
+    for (uint32_t i = 0; i < count; i++) {
+        free(items[i]);
+    }
+    free(kinds);
+    free(items);
+    free(lens);
+    free(jobs);
+    free(data);
+    free(data_lens);
+    free(digests);
+    free(response);
+    return ret;
+}
+
+/*
+ * return: NULL if the other options work with --serve and --client, else the first one that does not;
+ * the protocol carries plain SM3 digests, and the time of a run is spent in the server
+ */
+const char *serve_conflict() {
+    if (sm3_args.check_mode) {
+        return "-c";
+    }
+    if (sm3_args.tree_chunk != 0) {
+        return "--tree";
+    }
+    if (sm3_args.tree_digest) {
+        return "--tree-digest";
+    }
+    if (sm3_args.find_duplicates) {
+        return "--find-duplicates";
+    }
+    if (sm3_args.stats) {
+        return "--stats";
+    }
+    if (sm3_args.hmac_key != NULL) {
+        return "--hmac-key-file";
+    }
+    return NULL;
+}
+
+/*
+ * fd: connected socket, closed once the client is done
+ * function: answer batches until the client closes the connection
+ */
+void serve_connection(int fd) {
+    while (serve_batch(fd) == 0) {
+    }
+    close(fd);
+}
+
+static void *connection_run(void *arg) {
+    serve_connection((int)(intptr_t)arg);
+    return NULL;
+}
+
+static void stop(int sig) {
+    (void)sig;
+    unlink(listen_path);
+    _exit(0);
+}
+
+/*
+ * socket_path: where to listen, a socket left there by an earlier server is replaced
+ * function: accept connections until SIGINT or SIGTERM, the socket is only open to its owner
+ * return: -1 if the socket cannot be set up
+ */
+int serve(const char *socket_path) {
+    struct sockaddr_un addr;
+    struct stat st;
+    if (strlen(socket_path) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "sm3sum: socket path too long: %s\n", socket_path);
+        return -1;
+    }
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, socket_path);
+    if (lstat(socket_path, &st) == 0 && S_ISSOCK(st.st_mode)) {
+        unlink(socket_path);
+    }
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    mode_t mask = umask(0077);
+    int bound = fd >= 0 ? bind(fd, (struct sockaddr *)&addr, sizeof(addr)) : -1;
+    umask(mask);
+    if (bound != 0 || listen(fd, SOMAXCONN) != 0) {
+        fprintf(stderr, "sm3sum: cannot listen on %s: %s\n", socket_path, strerror(errno));
+        if (fd >= 0) {
+            close(fd);
+        }
+        return -1;
+    }
+    listen_path = socket_path;
+    signal(SIGPIPE, SIG_IGN);
+    signal(SIGINT, stop);
+    signal(SIGTERM, stop);
+    while (true) {
+        int conn = accept4(fd, NULL, NULL, SOCK_CLOEXEC);
+        if (conn < 0) {
+            if (errno == EINTR || errno == ECONNABORTED || errno == EMFILE || errno == ENFILE) {
+                continue;
+            }
+            fprintf(stderr, "sm3sum: cannot accept on %s: %s\n", socket_path, strerror(errno));
+            close(fd);
+            unlink(socket_path);
+            return -1;
+        }
+        pthread_t thread;
+        if (pthread_create(&thread, NULL, connection_run, (void *)(intptr_t)conn) != 0) {
+            close(conn);
+            continue;
+        }
+        pthread_detach(thread);
+    }
+}
+
+/*
+ * return: socket connected to the server at socket_path, -1 on failure
+ */
+int serve_connect(const char *socket_path) {
+    struct sockaddr_un addr;
+    if (strlen(socket_path) >= sizeof(addr.sun_path)) {
+        return -1;
+    }
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, socket_path);
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd >= 0 && connect(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+/*
+ * fd: socket from serve_connect()
+ * requests: count entries, at most SERVE_BATCH_MAX holding at most SERVE_BATCH_BYTES
+ * digests: count * SM3_DIGEST_SIZE bytes, receive the digests in the order of requests
+ * failed: count entries, set for files the server could not read
+ * return: 0 on success, -1 if the server went away
+ */
+int serve_call(int fd, const serve_request *requests, size_t count, uint8_t *digests, bool *failed) {
+    size_t size = 4;
+    for (size_t i = 0; i < count; i++) {
+        size += 5 + requests[i].len;
+    }
+    uint8_t *buf = (uint8_t *)malloc(size > count * SERVE_RESPONSE_SIZE ? size : count * SERVE_RESPONSE_SIZE);
+    if (buf == NULL) {
+        fprintf(stderr, "sm3sum: out of memory\n");
+        exit(1);
+    }
+    // the whole batch leaves in one write
+    uint8_t *p = put_be32(buf, count);
+    for (size_t i = 0; i < count; i++) {
+        *p++ = requests[i].kind;
+        p = put_be32(p, requests[i].len);
+        memcpy(p, requests[i].data, requests[i].len);
+        p += requests[i].len;
+    }
+    int ret = -1;
+    if (write_full(fd, buf, size) == 0 && read_full(fd, buf, count * SERVE_RESPONSE_SIZE) == 0) {
+        for (size_t i = 0; i < count; i++) {
+            failed[i] = buf[i * SERVE_RESPONSE_SIZE] != 0;
+            memcpy(digests + i * SM3_DIGEST_SIZE, buf + i * SERVE_RESPONSE_SIZE + 1, SM3_DIGEST_SIZE);
+        }
+        ret = 0;
+    }
+    free(buf);
+    return ret;
+}
@@ -0,0 +1,28 @@
+#ifndef SERVE_H
+#define SERVE_H
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+/*
+ * This header contains declearations of --serve, a hashing daemon on a Unix
+ * domain socket, and of its client, which saves a process start per input
+ */
+
+#define SERVE_PATH 'P' // request for the digest of a file, by absolute path
+#define SERVE_DATA 'D' // request for the digest of the bytes sent along
+#define SERVE_BATCH_MAX 4096 // requests per batch
+#define SERVE_BATCH_BYTES (64 << 20) // most bytes of paths and inline data in one batch
+
+typedef struct {
+    char kind; // SERVE_PATH or SERVE_DATA
+    const void *data;
+    size_t len;
+} serve_request;
+
+const char *serve_conflict();
+int serve(const char *socket_path);
+void serve_connection(int fd);
+int serve_connect(const char *socket_path);
+int serve_call(int fd, const serve_request *requests, size_t count, uint8_t *digests, bool *failed);
+
+#endif // SERVE_H
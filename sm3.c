@@ -3,8 +3,8 @@
 #include <stddef.h>
 #include <stdbool.h>
 #include <stdlib.h>
-#include <assert.h>
 #include <stdio.h>
+#include <string.h>
 
 uint64_t local_to_be(uint64_t data) {
 #ifdef SM3_BIG_ENDIAN
@@ -51,239 +51,433 @@ bool endian_check() {
 }
 
 /*
- * buf: buffer that contains content, at least bsize + 2 * BLOCK_SIZE bits
- * bsize: buffer size in BITS
- * function: the first stage of sm3 algorithm
+ * cyclic left shift
+ * expect local endian data, shift must be in 1..31
  */
-void sm3_padding(uint8_t *buf, size_t *bsize, size_t tot_len) {
-    // append one 1 bit
-    size_t byte_offset = *bsize / 8;
-    size_t byte_append = 1 << (7 - *bsize % 8);
-    buf[byte_offset] |= byte_append;
-    *bsize += 1;
-
-    uint64_t *buf_64 = (uint64_t *)buf;
-    uint64_t bsize_be = local_to_be(tot_len);
-    if (*bsize % BLOCK_SIZE <= 448) {
-        // size info suits well into the last block
-        buf_64[*bsize / 512 * 8 + 7] = bsize_be;
-        *bsize = ((*bsize / 512) + 1) * 512; // align to this block boundary
-    } else {
-        // adding a new block
-        buf_64[*bsize / 512 * 8 + 15] = bsize_be;
-        *bsize = ((*bsize / 512) + 2) * 512; // align to next block boundary
-    }
-#ifdef DEBUG
-    /*
-    for (int i = 0; i < (*bsize / 8); i++) {
-        printf("%2x ", buf[i]);
-        if (i % 32 == 31) {
-            printf("\n");
+static inline uint32_t cls(uint32_t data, uint32_t shift) {
+    return (data >> (32 - shift)) | (data << shift);
+}
+
+/*
+ * read a big endian word from a possibly unaligned address, return local endian
+ */
+static inline uint32_t load_be32(const uint8_t *p) {
+    return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) |
+           ((uint32_t)p[2] << 8) | (uint32_t)p[3];
+}
+
+/*
+ * write a local endian word to a possibly unaligned address in big endian
+ */
+static inline void store_be32(uint8_t *p, uint32_t data) {
+    p[0] = (uint8_t)(data >> 24);
+    p[1] = (uint8_t)(data >> 16);
+    p[2] = (uint8_t)(data >> 8);
+    p[3] = (uint8_t)data;
+}
+
+/*
+ * FFj and GGj, j = 0 to 15 and j = 16 to 63 are split so that no branch is left in the rounds
+ */
+#define FF0(x, y, z) ((x) ^ (y) ^ (z))
+#define FF1(x, y, z) (((x) & (y)) | (((x) | (y)) & (z)))
+#define GG0(x, y, z) ((x) ^ (y) ^ (z))
+#define GG1(x, y, z) ((((y) ^ (z)) & (x)) ^ (z))
+
+#define P0(x) ((x) ^ cls((x), 9) ^ cls((x), 17))
+#define P1(x) ((x) ^ cls((x), 15) ^ cls((x), 23))
+
+/*
+ * Tj <<< (j mod 32), precomputed so that the rounds only need an add
+ */
+const uint32_t sm3_T_rot[64] = {
+    0x79cc4519, 0xf3988a32, 0xe7311465, 0xce6228cb,
+    0x9cc45197, 0x3988a32f, 0x7311465e, 0xe6228cbc,
+    0xcc451979, 0x988a32f3, 0x311465e7, 0x6228cbce,
+    0xc451979c, 0x88a32f39, 0x11465e73, 0x228cbce6,
+    0x9d8a7a87, 0x3b14f50f, 0x7629ea1e, 0xec53d43c,
+    0xd8a7a879, 0xb14f50f3, 0x629ea1e7, 0xc53d43ce,
+    0x8a7a879d, 0x14f50f3b, 0x29ea1e76, 0x53d43cec,
+    0xa7a879d8, 0x4f50f3b1, 0x9ea1e762, 0x3d43cec5,
+    0x7a879d8a, 0xf50f3b14, 0xea1e7629, 0xd43cec53,
+    0xa879d8a7, 0x50f3b14f, 0xa1e7629e, 0x43cec53d,
+    0x879d8a7a, 0x0f3b14f5, 0x1e7629ea, 0x3cec53d4,
+    0x79d8a7a8, 0xf3b14f50, 0xe7629ea1, 0xcec53d43,
+    0x9d8a7a87, 0x3b14f50f, 0x7629ea1e, 0xec53d43c,
+    0xd8a7a879, 0xb14f50f3, 0x629ea1e7, 0xc53d43ce,
+    0x8a7a879d, 0x14f50f3b, 0x29ea1e76, 0x53d43cec,
+    0xa7a879d8, 0x4f50f3b1, 0x9ea1e762, 0x3d43cec5,
+};
+
+/*
+ * W_j for j >= 16, computed in place in a 16-word ring
+ * W[j & 15] holds W_{j-16} before it is overwritten
+ */
+#define W_EXPAND(W, j) \
+    (W[(j) & 15] = P1(W[(j) & 15] ^ W[((j) - 9) & 15] ^ cls(W[((j) - 3) & 15], 15)) ^ \
+                   cls(W[((j) - 13) & 15], 7) ^ W[((j) - 6) & 15])
+
+/*
+ * one round, Wj is W_j and Wpj is W'_j
+ * instead of moving all eight registers, the caller rotates the argument order:
+ * after the round, D holds the new A and H holds the new E
+ */
+#define SM3_ROUND(A, B, C, D, E, F, G, H, FF, GG, j, Wj, Wpj) do { \
+    uint32_t a12 = cls(A, 12); \
+    uint32_t ss1 = cls(a12 + E + sm3_T_rot[j], 7); \
+    uint32_t ss2 = ss1 ^ a12; \
+    D = FF(A, B, C) + D + ss2 + (Wpj); \
+    H = GG(E, F, G) + H + ss1 + (Wj); \
+    B = cls(B, 9); \
+    F = cls(F, 19); \
+    H = P0(H); \
+} while (0)
+
+#define SM3_ROUND4(FF, GG, j, Wj, Wpj) do { \
+    SM3_ROUND(A, B, C, D, E, F, G, H, FF, GG, (j) + 0, Wj(0), Wpj(0)); \
+    SM3_ROUND(D, A, B, C, H, E, F, G, FF, GG, (j) + 1, Wj(1), Wpj(1)); \
+    SM3_ROUND(C, D, A, B, G, H, E, F, FF, GG, (j) + 2, Wj(2), Wpj(2)); \
+    SM3_ROUND(B, C, D, A, F, G, H, E, FF, GG, (j) + 3, Wj(3), Wpj(3)); \
+} while (0)
+
+/*
+ * V: chaining value to be updated (in local endian)
+ * buf: content, nblocks * 512 bits, no alignment required
+ * nblocks: number of 512-bit blocks in buf
+ * function: the compression stage of sm3 algorithm, portable version
+ */
+static void sm3_iterate_generic(uint32_t *V, const uint8_t *buf, size_t nblocks) {
+    uint32_t A, B, C, D, E, F, G, H;
+    uint32_t W[16];
+    int j;
+
+    for (size_t i = 0; i < nblocks; i++, buf += SM3_BLOCK_BYTES) {
+        for (j = 0; j < 16; j++) {
+            W[j] = load_be32(buf + j * WORDSIZE);
         }
+        A = V[0];
+        B = V[1];
+        C = V[2];
+        D = V[3];
+        E = V[4];
+        F = V[5];
+        G = V[6];
+        H = V[7];
+// W_0 to W_15 are loaded, W_{j+4} is expanded right before the round that needs it
+#define W_LOAD(k) W[(j + (k)) & 15]
+#define WP_AHEAD(k) (W_LOAD(k) ^ W[j + 4 + (k)])
+#define WP_NEXT(k) (W_LOAD(k) ^ W_EXPAND(W, j + 4 + (k)))
+        for (j = 0; j < 12; j += 4) {
+            SM3_ROUND4(FF0, GG0, j, W_LOAD, WP_AHEAD);
+        }
+        SM3_ROUND4(FF0, GG0, 12, W_LOAD, WP_NEXT);
+        for (j = 16; j < 64; j += 4) {
+            SM3_ROUND4(FF1, GG1, j, W_LOAD, WP_NEXT);
+        }
+#undef W_LOAD
+#undef WP_AHEAD
+#undef WP_NEXT
+        V[0] ^= A;
+        V[1] ^= B;
+        V[2] ^= C;
+        V[3] ^= D;
+        V[4] ^= E;
+        V[5] ^= F;
+        V[6] ^= G;
+        V[7] ^= H;
     }
-    printf("\n");
-    */
-#endif // DEBUG
 }
 
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+
+#define ROL128(x, n) _mm_or_si128(_mm_slli_epi32((x), (n)), _mm_srli_epi32((x), 32 - (n)))
+#define XOR128(x, y) _mm_xor_si128((x), (y))
 
 /*
- * cyclic left shift
- * expect local endian data
+ * message schedule of one block in SSE registers
+ * W: W_0 to W_67, the last 3-word step spills up to W_70
+ * WP: W'_0 to W'_63
  */
-uint32_t cls(uint32_t data, uint32_t shift) {
-    uint32_t ret;
-    ret = (data >> (32 - shift)) | (data << shift);
-    return ret;
+typedef struct {
+    uint32_t W[72] __attribute__((aligned(16)));
+    uint32_t WP[64] __attribute__((aligned(16)));
+} sm3_schedule;
+
+#define SCHED_STEPS 18 // W_16 to W_67, 3 words per step
+
+/*
+ * load a block into W_0 to W_15, one shuffle does the byte swap of 4 words
+ */
+static inline __attribute__((target("ssse3"))) void sched_load(sm3_schedule *s, const uint8_t *buf) {
+    const __m128i bswap = _mm_setr_epi8(3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12);
+    for (int j = 0; j < 16; j += 4) {
+        __m128i m = _mm_loadu_si128((const __m128i *)(buf + j * WORDSIZE));
+        _mm_store_si128((__m128i *)(s->W + j), _mm_shuffle_epi8(m, bswap));
+    }
 }
 
 /*
- * FFj function, expect local endian but actually does not matter
+ * expansion steps [from, to), step k computes W_{16+3k} to W_{18+3k}
+ * W_{j+3} depends on W_j, so the fourth lane is dropped and recomputed by the next step
  */
-uint32_t FFj(uint32_t x, uint32_t y, uint32_t z, uint32_t j) {
-    assert(j >= 0 && j < 64);
-    if (j <= 15) {
-        return x ^ y ^ z;
-    } else {
-        return (x & y) | (x & z) | (y & z);
+static inline __attribute__((target("ssse3"))) void sched_expand(sm3_schedule *s, int from, int to) {
+    uint32_t *W = s->W;
+    for (int k = from; k < to; k++) {
+        int j = 16 + 3 * k;
+        __m128i x = XOR128(_mm_loadu_si128((const __m128i *)(W + j - 16)),
+                           _mm_loadu_si128((const __m128i *)(W + j - 9)));
+        x = XOR128(x, ROL128(_mm_loadu_si128((const __m128i *)(W + j - 3)), 15));
+        x = XOR128(XOR128(x, ROL128(x, 15)), ROL128(x, 23));
+        x = XOR128(x, ROL128(_mm_loadu_si128((const __m128i *)(W + j - 13)), 7));
+        x = XOR128(x, _mm_loadu_si128((const __m128i *)(W + j - 6)));
+        _mm_storeu_si128((__m128i *)(W + j), x);
     }
 }
 
 /*
- * GGj function, expect local endian but actually does not matter
+ * W'_j = W_j ^ W_{j+4}, 4 words at a time
  */
-uint32_t GGj(uint32_t x, uint32_t y, uint32_t z, uint32_t j) {
-    assert(j >= 0 && j < 64);
-    if (j <= 15) {
-        return x ^ y ^ z;
-    } else {
-        return (x & y) | ((~x) & z);
+static inline __attribute__((target("ssse3"))) void sched_prime(sm3_schedule *s) {
+    for (int j = 0; j < 64; j += 4) {
+        __m128i w = _mm_load_si128((const __m128i *)(s->W + j));
+        __m128i w4 = _mm_load_si128((const __m128i *)(s->W + j + 4));
+        _mm_store_si128((__m128i *)(s->WP + j), XOR128(w, w4));
     }
 }
 
 /*
- * Tj function, return local endian data
+ * V: chaining value to be updated (in local endian)
+ * buf: content, nblocks * 512 bits, no alignment required
+ * nblocks: number of 512-bit blocks in buf
+ * function: the compression stage of sm3 algorithm, with the message expansion done in SSE registers
+ * the schedule of block i + 1 is computed in four slices placed between the rounds of block i,
+ * it does not depend on the chaining value, so the vector units run it alongside the scalar rounds
  */
-uint32_t Tj(uint32_t j) {
-    assert(j >= 0 && j <= 63);
-    if (j <= 15) return 0x79cc4519;
-    else return 0x7a879d8a;
+static __attribute__((target("ssse3"))) void sm3_iterate_ssse3(uint32_t *V, const uint8_t *buf, size_t nblocks) {
+    sm3_schedule sched[2];
+    uint32_t A, B, C, D, E, F, G, H;
+    int j;
+
+    if (nblocks == 0) {
+        return;
+    }
+    // the first step reads W_16 through its dropped lane, keep it defined
+    sched[0].W[16] = sched[1].W[16] = 0;
+    sched_load(&sched[0], buf);
+    sched_expand(&sched[0], 0, SCHED_STEPS);
+    sched_prime(&sched[0]);
+    for (size_t i = 0; i < nblocks; i++, buf += SM3_BLOCK_BYTES) {
+        const uint32_t *W = sched[i & 1].W;
+        const uint32_t *WP = sched[i & 1].WP;
+        sm3_schedule *next = &sched[(i + 1) & 1];
+        // past the last block, the next schedule is computed from this block and thrown away
+        const uint8_t *next_buf = i + 1 < nblocks ? buf + SM3_BLOCK_BYTES : buf;
+
+        A = V[0];
+        B = V[1];
+        C = V[2];
+        D = V[3];
+        E = V[4];
+        F = V[5];
+        G = V[6];
+        H = V[7];
+#define W_ARRAY(k) W[j + (k)]
+#define WP_ARRAY(k) WP[j + (k)]
+        sched_load(next, next_buf);
+        sched_expand(next, 0, 5);
+        for (j = 0; j < 16; j += 4) {
+            SM3_ROUND4(FF0, GG0, j, W_ARRAY, WP_ARRAY);
+        }
+        sched_expand(next, 5, 10);
+        for (j = 16; j < 32; j += 4) {
+            SM3_ROUND4(FF1, GG1, j, W_ARRAY, WP_ARRAY);
+        }
+        sched_expand(next, 10, 15);
+        for (j = 32; j < 48; j += 4) {
+            SM3_ROUND4(FF1, GG1, j, W_ARRAY, WP_ARRAY);
+        }
+        sched_expand(next, 15, SCHED_STEPS);
+        sched_prime(next);
+        for (j = 48; j < 64; j += 4) {
+            SM3_ROUND4(FF1, GG1, j, W_ARRAY, WP_ARRAY);
+        }
+#undef W_ARRAY
+#undef WP_ARRAY
+        V[0] ^= A;
+        V[1] ^= B;
+        V[2] ^= C;
+        V[3] ^= D;
+        V[4] ^= E;
+        V[5] ^= F;
+        V[6] ^= G;
+        V[7] ^= H;
+    }
+}
+
+static bool cpu_has_ssse3() {
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("ssse3");
+}
+
+#endif
+
+static bool cpu_has_nothing() {
+    return true;
 }
 
 /*
- * P0 function, expect local endian
+ * compression kernels, fastest first
+ * the first one the cpu supports is used unless another one is selected
  */
-uint32_t P0(uint32_t x) {
-    return x ^ cls(x, 9) ^ cls(x, 17);
-} 
+static const sm3_kernel kernels[] = {
+#if defined(__x86_64__) || defined(__i386__)
+    {"ssse3", sm3_iterate_ssse3, cpu_has_ssse3},
+#endif
+    {"generic", sm3_iterate_generic, cpu_has_nothing},
+};
+
+static const sm3_kernel *active_kernel;
 
 /*
- * P1 function, expect local endian
+ * count: receives the number of kernels
+ * return: all kernels built into this binary, supported by the cpu or not
  */
-uint32_t P1(uint32_t x) {
-    return x ^ cls(x, 15) ^ cls(x, 23);
-} 
+const sm3_kernel *sm3_kernel_list(size_t *count) {
+    *count = sizeof(kernels) / sizeof(kernels[0]);
+    return kernels;
+}
 
 /*
- * generate W and W' (in big endian) from a 512-bit block
- * W: 0 to 67 W': 68 to 131
+ * return: the kernel sm3_iterate() runs, picked on first use if none was selected
  */
-uint32_t * sm3_word_gen(uint32_t *buf) {
-    uint32_t *ret = (uint32_t *)malloc(BSIZE * WORDSIZE);
-    for (int i = 0; i < 16; i++) {
-        ret[i] = buf[i];
+const sm3_kernel *sm3_kernel_current() {
+    const sm3_kernel *kernel = __atomic_load_n(&active_kernel, __ATOMIC_ACQUIRE);
+    if (kernel == NULL) {
+        // racing threads all come to the same choice
+        for (kernel = kernels; !kernel->supported(); kernel++);
+        __atomic_store_n(&active_kernel, kernel, __ATOMIC_RELEASE);
     }
-    uint32_t p1_arg, wj_local;
-    for (int i = 16; i < 68; i++) {
-        // W_16 to W_67
-        p1_arg = local_to_be32(ret[i - 16] ^ ret[i - 9]) ^ cls(local_to_be32(ret[i - 3]), 15);
-        wj_local = P1(p1_arg) ^ cls(local_to_be32(ret[i - 13]), 7) ^ local_to_be32(ret[i - 6]);
-        ret[i] = local_to_be32(wj_local);
-    }
-    for (int i = 0; i < 64; ++i) {
-        // endian does not matter for xor
-        ret[i + 68] = ret[i] ^ ret[i + 4];
+    return kernel;
+}
+
+/*
+ * name: name of a kernel in sm3_kernel_list()
+ * return: 0 on success, -1 if there is no such kernel or the cpu does not support it
+ */
+int sm3_kernel_select(const char *name) {
+    size_t count;
+    const sm3_kernel *list = sm3_kernel_list(&count);
+    for (size_t i = 0; i < count; i++) {
+        if (strcmp(list[i].name, name) == 0) {
+            if (!list[i].supported()) {
+                return -1;
+            }
+            __atomic_store_n(&active_kernel, &list[i], __ATOMIC_RELEASE);
+            return 0;
+        }
     }
-    return ret;
+    return -1;
 }
 
+/*
+ * V: chaining value to be updated (in local endian)
+ * buf: content, nblocks * 512 bits, no alignment required
+ * nblocks: number of 512-bit blocks in buf
+ * function: the compression stage of sm3 algorithm, runs the selected kernel
+ */
+void sm3_iterate(uint32_t *V, const uint8_t *buf, size_t nblocks) {
+    sm3_kernel_current()->iterate(V, buf, nblocks);
+}
 
-uint32_t V[8];
 /*
- * There can be re-run, V should be able to be reset
+ * There can be re-run, ctx should be able to be reset
  */
-void V_init() {
-    V[0] = local_to_be32(IV0);
-    V[1] = local_to_be32(IV1);
-    V[2] = local_to_be32(IV2);
-    V[3] = local_to_be32(IV3);
-    V[4] = local_to_be32(IV4);
-    V[5] = local_to_be32(IV5);
-    V[6] = local_to_be32(IV6);
-    V[7] = local_to_be32(IV7);
+void sm3_init(sm3_ctx *ctx) {
+    ctx->V[0] = IV0;
+    ctx->V[1] = IV1;
+    ctx->V[2] = IV2;
+    ctx->V[3] = IV3;
+    ctx->V[4] = IV4;
+    ctx->V[5] = IV5;
+    ctx->V[6] = IV6;
+    ctx->V[7] = IV7;
+    ctx->buf_len = 0;
+    ctx->total_len = 0;
 }
 
-void sm3_iterate(uint8_t *buf, size_t bsize) {
-    // for (int i = 0; i < 8; i++) V[i] = local_to_be32(V[i]);
-    // V[i] has correct IV in big endian now
-
-    uint32_t A, B, C, D, E, F, G, H, SS1, SS2, TT1, TT2;
-    // iterate to generate V_n
-    for (int i = 0; i < bsize / BLOCK_SIZE; i++) {
-        // generate W_i
-        uint32_t *w_buf = sm3_word_gen((uint32_t *)(buf + i * BLOCK_SIZE / 8));
-#ifdef DEBUG
-        uint8_t *w_buf_8 = (uint8_t *)w_buf;
-        printf("W array:\n");
-        for (int i = 0; i < 68 * 4; i++) {
-            printf("%2x", w_buf_8[i]);
-            if (i % 4 == 3) printf(" ");
-            if (i % 32 == 31) printf("\n");
-        }
-        printf("\nW' array:\n");
-        for (int i = 0; i < 64 * 4; i++) {
-            printf("%2x", w_buf_8[i + 68 * 4]);
-            if (i % 4 == 3) printf(" ");
-            if (i % 32 == 31) printf("\n");
-        }
-#endif // DEBUG
-        // calculate V_i
-        // note that we read big endian data, convert it to local endian, compute and just before write back, turn back to big endian
-        A = local_to_be32(V[0]);
-        B = local_to_be32(V[1]);
-        C = local_to_be32(V[2]);
-        D = local_to_be32(V[3]);
-        E = local_to_be32(V[4]);
-        F = local_to_be32(V[5]);
-        G = local_to_be32(V[6]);
-        H = local_to_be32(V[7]);
-        for (int i = 0; i < 64; i++) {
-            SS1 = cls(cls(A, 12) + E + cls(Tj(i), i), 7);
-            SS2 = SS1 ^ cls(A, 12);
-            TT1 = FFj(A, B, C, i) + D + SS2 + local_to_be32(w_buf[68 + i]);
-            TT2 = GGj(E, F, G, i) + H + SS1 + local_to_be32(w_buf[i]);
-            D = C;
-            C = cls(B, 9);
-            B = A;
-            A = TT1;
-            H = G;
-            G = cls(F, 19);
-            F = E;
-            E = P0(TT2);
-#ifdef DEBUG
-            printf("%d iter: A=%8x B=%8x C=%8x D=%8x E=%8x F=%8x G=%8x H=%8x\n", i, A, B, C, D, E, F, G, H);
-#endif // DEBUG
+/*
+ * data: content to be hashed, any length
+ * len: data size in bytes
+ * function: feed whole blocks to sm3_iterate and keep the remainder in ctx
+ */
+void sm3_update(sm3_ctx *ctx, const void *data, size_t len) {
+    const uint8_t *ptr = (const uint8_t *)data;
+    ctx->total_len += len;
+    if (ctx->buf_len > 0) {
+        // complete the pending block first
+        size_t fill = SM3_BLOCK_BYTES - ctx->buf_len;
+        if (len < fill) {
+            memcpy(ctx->buf + ctx->buf_len, ptr, len);
+            ctx->buf_len += len;
+            return;
         }
-        A = local_to_be32(A);
-        B = local_to_be32(B);
-        C = local_to_be32(C);
-        D = local_to_be32(D);
-        E = local_to_be32(E);
-        F = local_to_be32(F);
-        G = local_to_be32(G);
-        H = local_to_be32(H);
-        V[0] = A ^ V[0];
-        V[1] = B ^ V[1];
-        V[2] = C ^ V[2];
-        V[3] = D ^ V[3];
-        V[4] = E ^ V[4];
-        V[5] = F ^ V[5];
-        V[6] = G ^ V[6];
-        V[7] = H ^ V[7];
-
-
-
-        free(w_buf);
+        memcpy(ctx->buf + ctx->buf_len, ptr, fill);
+        sm3_iterate(ctx->V, ctx->buf, 1);
+        ptr += fill;
+        len -= fill;
+        ctx->buf_len = 0;
+    }
+    if (len >= SM3_BLOCK_BYTES) {
+        size_t nblocks = len / SM3_BLOCK_BYTES;
+        sm3_iterate(ctx->V, ptr, nblocks);
+        ptr += nblocks * SM3_BLOCK_BYTES;
+        len -= nblocks * SM3_BLOCK_BYTES;
+    }
+    if (len > 0) {
+        memcpy(ctx->buf, ptr, len);
+        ctx->buf_len = len;
     }
-    
 }
 
-
-extern sm3_arguments sm3_args;
 /*
- * function: print the sm3 result
+ * digest: at least SM3_DIGEST_SIZE bytes, receives the hash value
+ * function: the padding stage of sm3 algorithm, ctx must be re-initialized before reuse
  */
-void sm3_print(char *file_name) {
-    if (sm3_args.bsd_tag) {
-        printf("SM3 (%s) = ", file_name);
+void sm3_final(sm3_ctx *ctx, uint8_t *digest) {
+    uint64_t bit_len_be = local_to_be(ctx->total_len * BYTE_SIZE);
+    // append one 1 bit
+    ctx->buf[ctx->buf_len++] = 0x80;
+    if (ctx->buf_len > SM3_BLOCK_BYTES - sizeof(uint64_t)) {
+        // size info does not fit into this block, adding a new block
+        memset(ctx->buf + ctx->buf_len, 0, SM3_BLOCK_BYTES - ctx->buf_len);
+        sm3_iterate(ctx->V, ctx->buf, 1);
+        ctx->buf_len = 0;
     }
+    memset(ctx->buf + ctx->buf_len, 0, SM3_BLOCK_BYTES - sizeof(uint64_t) - ctx->buf_len);
+    memcpy(ctx->buf + SM3_BLOCK_BYTES - sizeof(uint64_t), &bit_len_be, sizeof(uint64_t));
+    sm3_iterate(ctx->V, ctx->buf, 1);
     for (int i = 0; i < 8; i++) {
-        printf("%x", local_to_be32(V[i]));
-    }
-    if (!sm3_args.bsd_tag) {
-        printf(" %s", file_name);
+        store_be32(digest + i * WORDSIZE, ctx->V[i]);
     }
-    printf("\n");
 }
 
 /* 
- * buf: buffer that contains content
- * bsize: buffer size in BITS
- * function: main function of sm3 algorithm
+ * data: buffer that contains content
+ * len: buffer size in bytes
+ * digest: at least SM3_DIGEST_SIZE bytes
+ * function: one-shot sm3 of a buffer
  */
-void sm3(uint8_t *buf, size_t *bsize) {
-    sm3_padding(buf, bsize, *bsize);
-    assert(*bsize % BLOCK_SIZE == 0); // must have been padded
-    sm3_iterate(buf, *bsize);
+void sm3(const void *data, size_t len, uint8_t *digest) {
+    sm3_ctx ctx;
+    sm3_init(&ctx);
+    sm3_update(&ctx, data, len);
+    sm3_final(&ctx, digest);
 }
 
+/*
+ * return: version of the library, SM3_VERSION of the libsm3.h it was built with
+ */
+const char *sm3_version() {
+    return SM3_VERSION;
+}
@@ -3,6 +3,7 @@
 #include <stddef.h>
 #include <stdint.h>
 #include <stdbool.h>
+#include "libsm3.h"
 /*
  * This header contains declearations of SM3 algorithim functions
  */
@@ -24,12 +25,25 @@
 #define PATH_LIMIT 1024 // adjust if needed
 #define HASH_LIMIT 64 // adjust if needed
 
-#define BSIZE 132
 #define WORDSIZE 4
-void sm3_padding(uint8_t *buf, size_t *bsize, size_t totsize);
-void sm3_iterate(uint8_t *buf, size_t bsize);
-void sm3_print(char *file_name);
-void V_init();
+// SM3_BLOCK_BYTES (BLOCK_SIZE / BYTE_SIZE) and SM3_DIGEST_SIZE come from libsm3.h
+
+void sm3_iterate(uint32_t *V, const uint8_t *buf, size_t nblocks);
+
+/*
+ * a compression kernel that sm3_iterate() can run
+ * supported: checks the cpu features the kernel needs
+ */
+typedef struct {
+    const char *name;
+    void (*iterate)(uint32_t *V, const uint8_t *buf, size_t nblocks);
+    bool (*supported)();
+} sm3_kernel;
+
+const sm3_kernel *sm3_kernel_list(size_t *count);
+const sm3_kernel *sm3_kernel_current();
+int sm3_kernel_select(const char *name);
+extern const uint32_t sm3_T_rot[64];
 
 /*
  * file_list is used for both directly given file names */
@@ -38,6 +52,15 @@ typedef struct file_list {
     char *file_name;
 } file_list;
 
+/*
+ * how files are read, see --io
+ */
+typedef enum {
+    IO_MMAP = 0, // mmap regular files, read pipeline with io_uring for the rest
+    IO_URING, // read pipeline with io_uring wherever possible
+    IO_THREAD, // read pipeline with a reader thread
+} sm3_io_mode;
+
 typedef struct {
     bool stdio;
     bool check_mode;
@@ -48,11 +71,27 @@ typedef struct {
     bool status;
     bool strict;
     bool warn;
+    int jobs; // number of hashing threads, 0 for one per online cpu
+    size_t tree_chunk; // --tree chunk size in bytes, 0 for plain SM3
+    sm3_io_mode io_mode;
+    bool direct; // --direct, keep file data out of the page cache
+    const char *cache_file; // --cache, digest cache file, NULL for none
+    bool refresh_cache; // --refresh-cache, hash every file and update its cache entry
+    bool recursive; // -r, hash the files under directories
+    bool follow_symlinks; // -L, follow symbolic links met by -r
+    bool one_file_system; // -x, -r stays on the file system of each directory given
+    bool tree_digest; // --tree-digest, one SM3DIR digest per directory given
+    bool manifest; // --manifest, --tree-digest also prints the digest of every file
+    bool find_duplicates; // --find-duplicates, print groups of files with identical contents
+    size_t resume_interval; // --resume, bytes between two checkpoints, 0 for no checkpoints
+    bool stats; // --stats, report where the time of the run went
+    const char *stats_file; // --stats=FILE, JSON statistics, NULL for text on stderr
+    const sm3_hmac_key *hmac_key; // --hmac-key-file, HMAC-SM3 of every input under this key, NULL for SM3
+    const char *serve_socket; // --serve, Unix socket to answer hash requests on, NULL for none
+    const char *client_socket; // --client, Unix socket of the server to send the inputs to, NULL for none
     file_list head, *tail;
 } sm3_arguments;
 
-extern uint32_t V[8];
-
 uint64_t local_to_be(uint64_t data);
 uint32_t local_to_be32(uint32_t data);
 
@@ -0,0 +1,351 @@
+#include "sm3_mb.h"
+#include "sm3.h"
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include <string.h>
+#include <assert.h>
+
+/*
+ * Multi-buffer SM3: lane l of every vector belongs to message l, so eight
+ * independent messages advance through the rounds together.
+ * The AVX2 code is compiled with a target attribute instead of -mavx2,
+ * so that the binary still runs on CPUs without AVX2 (sm3_mb_available()
+ * tells the caller whether a SIMD kernel is selected).
+ */
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+
+#define SM3_AVX2 __attribute__((target("avx2")))
+
+static bool cpu_has_avx2() {
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("avx2");
+}
+
+#define VROL(x, n) _mm256_or_si256(_mm256_slli_epi32((x), (n)), _mm256_srli_epi32((x), 32 - (n)))
+#define VXOR3(x, y, z) _mm256_xor_si256(_mm256_xor_si256((x), (y)), (z))
+#define VADD(x, y) _mm256_add_epi32((x), (y))
+
+#define VFF0(x, y, z) VXOR3(x, y, z)
+#define VFF1(x, y, z) _mm256_or_si256(_mm256_and_si256((x), (y)), _mm256_and_si256(_mm256_or_si256((x), (y)), (z)))
+#define VGG0(x, y, z) VXOR3(x, y, z)
+#define VGG1(x, y, z) _mm256_xor_si256(_mm256_and_si256(_mm256_xor_si256((y), (z)), (x)), (z))
+
+#define VP0(x) VXOR3((x), VROL((x), 9), VROL((x), 17))
+#define VP1(x) VXOR3((x), VROL((x), 15), VROL((x), 23))
+
+/*
+ * same ring and argument rotation scheme as the scalar sm3_iterate()
+ */
+#define VW_EXPAND(W, j) \
+    (W[(j) & 15] = VXOR3(VP1(VXOR3(W[(j) & 15], W[((j) - 9) & 15], VROL(W[((j) - 3) & 15], 15))), \
+                         VROL(W[((j) - 13) & 15], 7), W[((j) - 6) & 15]))
+
+#define VSM3_ROUND(A, B, C, D, E, F, G, H, FF, GG, j, Wj, Wj4) do { \
+    __m256i a12 = VROL(A, 12); \
+    __m256i ss1 = VROL(VADD(VADD(a12, E), _mm256_set1_epi32(sm3_T_rot[j])), 7); \
+    __m256i ss2 = _mm256_xor_si256(ss1, a12); \
+    __m256i wj = (Wj); \
+    D = VADD(VADD(FF(A, B, C), D), VADD(ss2, _mm256_xor_si256(wj, (Wj4)))); \
+    H = VADD(VADD(GG(E, F, G), H), VADD(ss1, wj)); \
+    B = VROL(B, 9); \
+    F = VROL(F, 19); \
+    H = VP0(H); \
+} while (0)
+
+#define VSM3_ROUND4(FF, GG, j, Wj, Wj4) do { \
+    VSM3_ROUND(A, B, C, D, E, F, G, H, FF, GG, (j) + 0, Wj(0), Wj4(0)); \
+    VSM3_ROUND(D, A, B, C, H, E, F, G, FF, GG, (j) + 1, Wj(1), Wj4(1)); \
+    VSM3_ROUND(C, D, A, B, G, H, E, F, FF, GG, (j) + 2, Wj(2), Wj4(2)); \
+    VSM3_ROUND(B, C, D, A, F, G, H, E, FF, GG, (j) + 3, Wj(3), Wj4(3)); \
+} while (0)
+
+/*
+ * rows: eight vectors, row l holds eight consecutive words of lane l
+ * function: transpose in place so that row k holds word k of every lane
+ */
+static inline SM3_AVX2 void transpose8(__m256i *r) {
+    __m256i t0 = _mm256_unpacklo_epi32(r[0], r[1]);
+    __m256i t1 = _mm256_unpackhi_epi32(r[0], r[1]);
+    __m256i t2 = _mm256_unpacklo_epi32(r[2], r[3]);
+    __m256i t3 = _mm256_unpackhi_epi32(r[2], r[3]);
+    __m256i t4 = _mm256_unpacklo_epi32(r[4], r[5]);
+    __m256i t5 = _mm256_unpackhi_epi32(r[4], r[5]);
+    __m256i t6 = _mm256_unpacklo_epi32(r[6], r[7]);
+    __m256i t7 = _mm256_unpackhi_epi32(r[6], r[7]);
+    __m256i u0 = _mm256_unpacklo_epi64(t0, t2);
+    __m256i u1 = _mm256_unpackhi_epi64(t0, t2);
+    __m256i u2 = _mm256_unpacklo_epi64(t1, t3);
+    __m256i u3 = _mm256_unpackhi_epi64(t1, t3);
+    __m256i u4 = _mm256_unpacklo_epi64(t4, t6);
+    __m256i u5 = _mm256_unpackhi_epi64(t4, t6);
+    __m256i u6 = _mm256_unpacklo_epi64(t5, t7);
+    __m256i u7 = _mm256_unpackhi_epi64(t5, t7);
+    r[0] = _mm256_permute2x128_si256(u0, u4, 0x20);
+    r[1] = _mm256_permute2x128_si256(u1, u5, 0x20);
+    r[2] = _mm256_permute2x128_si256(u2, u6, 0x20);
+    r[3] = _mm256_permute2x128_si256(u3, u7, 0x20);
+    r[4] = _mm256_permute2x128_si256(u0, u4, 0x31);
+    r[5] = _mm256_permute2x128_si256(u1, u5, 0x31);
+    r[6] = _mm256_permute2x128_si256(u2, u6, 0x31);
+    r[7] = _mm256_permute2x128_si256(u3, u7, 0x31);
+}
+
+/*
+ * V: chaining value (in local endian) of each lane
+ * buf: content of each lane, nblocks * 512 bits each, no alignment required
+ * nblocks: number of 512-bit blocks consumed from every lane
+ * function: the compression stage of sm3 algorithm on eight messages at once
+ */
+static SM3_AVX2 void sm3_mb_iterate_avx2(uint32_t *V[SM3_MB_LANES], const uint8_t *buf[SM3_MB_LANES], size_t nblocks) {
+    const __m256i bswap = _mm256_setr_epi8(3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12,
+                                           3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12);
+    __m256i S[8], W[16];
+    __m256i A, B, C, D, E, F, G, H;
+    int j;
+
+    // state is transposed once per call, not once per block
+    for (int l = 0; l < SM3_MB_LANES; l++) {
+        S[l] = _mm256_loadu_si256((const __m256i *)V[l]);
+    }
+    transpose8(S);
+
+    for (size_t i = 0; i < nblocks; i++) {
+        size_t offset = i * SM3_BLOCK_BYTES;
+        for (int l = 0; l < SM3_MB_LANES; l++) {
+            W[l] = _mm256_shuffle_epi8(_mm256_loadu_si256((const __m256i *)(buf[l] + offset)), bswap);
+            W[l + 8] = _mm256_shuffle_epi8(_mm256_loadu_si256((const __m256i *)(buf[l] + offset + 32)), bswap);
+        }
+        transpose8(W);
+        transpose8(W + 8);
+
+        A = S[0];
+        B = S[1];
+        C = S[2];
+        D = S[3];
+        E = S[4];
+        F = S[5];
+        G = S[6];
+        H = S[7];
+#define W_LOAD(k) W[(j + (k)) & 15]
+#define W_AHEAD(k) W[j + 4 + (k)]
+#define W_NEXT(k) VW_EXPAND(W, j + 4 + (k))
+        for (j = 0; j < 12; j += 4) {
+            VSM3_ROUND4(VFF0, VGG0, j, W_LOAD, W_AHEAD);
+        }
+        VSM3_ROUND4(VFF0, VGG0, 12, W_LOAD, W_NEXT);
+        for (j = 16; j < 64; j += 4) {
+            VSM3_ROUND4(VFF1, VGG1, j, W_LOAD, W_NEXT);
+        }
+#undef W_LOAD
+#undef W_AHEAD
+#undef W_NEXT
+        S[0] = _mm256_xor_si256(S[0], A);
+        S[1] = _mm256_xor_si256(S[1], B);
+        S[2] = _mm256_xor_si256(S[2], C);
+        S[3] = _mm256_xor_si256(S[3], D);
+        S[4] = _mm256_xor_si256(S[4], E);
+        S[5] = _mm256_xor_si256(S[5], F);
+        S[6] = _mm256_xor_si256(S[6], G);
+        S[7] = _mm256_xor_si256(S[7], H);
+    }
+
+    transpose8(S);
+    for (int l = 0; l < SM3_MB_LANES; l++) {
+        _mm256_storeu_si256((__m256i *)V[l], S[l]);
+    }
+}
+
+#endif
+
+/*
+ * lanes are compressed one by one with sm3_iterate()
+ */
+static void sm3_mb_iterate_scalar(uint32_t *V[SM3_MB_LANES], const uint8_t *buf[SM3_MB_LANES], size_t nblocks) {
+    for (int l = 0; l < SM3_MB_LANES; l++) {
+        sm3_iterate(V[l], buf[l], nblocks);
+    }
+}
+
+static bool cpu_has_nothing() {
+    return true;
+}
+
+/*
+ * multi-buffer kernels, fastest first
+ * "none" means files are not interleaved at all
+ */
+static const sm3_mb_kernel mb_kernels[] = {
+#if defined(__x86_64__) || defined(__i386__)
+    {"avx2", sm3_mb_iterate_avx2, cpu_has_avx2},
+#endif
+    {"none", sm3_mb_iterate_scalar, cpu_has_nothing},
+};
+
+#define MB_KERNEL_NONE (&mb_kernels[sizeof(mb_kernels) / sizeof(mb_kernels[0]) - 1])
+
+static const sm3_mb_kernel *active_mb_kernel;
+
+/*
+ * count: receives the number of kernels
+ * return: all multi-buffer kernels built into this binary, supported by the cpu or not
+ */
+const sm3_mb_kernel *sm3_mb_kernel_list(size_t *count) {
+    *count = sizeof(mb_kernels) / sizeof(mb_kernels[0]);
+    return mb_kernels;
+}
+
+/*
+ * return: the kernel sm3_mb_iterate() runs, picked on first use if none was selected
+ */
+const sm3_mb_kernel *sm3_mb_kernel_current() {
+    const sm3_mb_kernel *kernel = __atomic_load_n(&active_mb_kernel, __ATOMIC_ACQUIRE);
+    if (kernel == NULL) {
+        for (kernel = mb_kernels; !kernel->supported(); kernel++);
+        __atomic_store_n(&active_mb_kernel, kernel, __ATOMIC_RELEASE);
+    }
+    return kernel;
+}
+
+/*
+ * name: name of a kernel in sm3_mb_kernel_list()
+ * return: 0 on success, -1 if there is no such kernel or the cpu does not support it
+ */
+int sm3_mb_kernel_select(const char *name) {
+    size_t count;
+    const sm3_mb_kernel *list = sm3_mb_kernel_list(&count);
+    for (size_t i = 0; i < count; i++) {
+        if (strcmp(list[i].name, name) == 0) {
+            if (!list[i].supported()) {
+                return -1;
+            }
+            __atomic_store_n(&active_mb_kernel, &list[i], __ATOMIC_RELEASE);
+            return 0;
+        }
+    }
+    return -1;
+}
+
+/*
+ * return: true if the selected kernel really hashes lanes in parallel
+ */
+bool sm3_mb_available() {
+    return sm3_mb_kernel_current() != MB_KERNEL_NONE;
+}
+
+void sm3_mb_iterate(uint32_t *V[SM3_MB_LANES], const uint8_t *buf[SM3_MB_LANES], size_t nblocks) {
+    sm3_mb_kernel_current()->iterate(V, buf, nblocks);
+}
+
+/*
+ * start: context every message continues from, a fresh one or a midstate (HMAC keys); it must
+ * hold no pending bytes (buf_len == 0), the lanes continue from start->V and total_len only
+ * data: count messages
+ * len: size in bytes of each message
+ * count: number of messages
+ * digests: count * SM3_DIGEST_SIZE bytes, receives the hash values in the order of data
+ * function: whole blocks of up to SM3_MB_LANES messages go through the multi-buffer kernel
+ * together, a lane takes the next message as soon as its own runs out of whole blocks
+ */
+void sm3_batch_ctx(const sm3_ctx *start, const void *const *data, const size_t *len, size_t count,
+                   uint8_t *digests) {
+    sm3_ctx ctx[SM3_MB_LANES];
+    size_t msg[SM3_MB_LANES]; // message in each lane, count for an idle lane
+    size_t pos[SM3_MB_LANES];
+    uint32_t *V[SM3_MB_LANES];
+    const uint8_t *buf[SM3_MB_LANES];
+    uint32_t dummy_V[8];
+    size_t next = 0;
+    assert(start->buf_len == 0);
+    if (!sm3_mb_available()) {
+        for (size_t i = 0; i < count; i++) {
+            sm3_ctx ctx = *start;
+            sm3_update(&ctx, data[i], len[i]);
+            sm3_final(&ctx, digests + i * SM3_DIGEST_SIZE);
+        }
+        return;
+    }
+    for (int l = 0; l < SM3_MB_LANES; l++) {
+        msg[l] = count;
+    }
+
+    while (true) {
+        int active = 0;
+        size_t nblocks = SIZE_MAX;
+        for (int l = 0; l < SM3_MB_LANES; l++) {
+            while (true) {
+                if (msg[l] < count && len[msg[l]] - pos[l] >= SM3_BLOCK_BYTES) {
+                    break;
+                }
+                if (msg[l] < count) {
+                    // the tail goes through the streaming api, which does the padding
+                    sm3_update(&ctx[l], (const uint8_t *)data[msg[l]] + pos[l], len[msg[l]] - pos[l]);
+                    sm3_final(&ctx[l], digests + msg[l] * SM3_DIGEST_SIZE);
+                    msg[l] = count;
+                }
+                if (next == count) {
+                    break;
+                }
+                msg[l] = next++;
+                pos[l] = 0;
+                ctx[l] = *start;
+            }
+            if (msg[l] < count) {
+                size_t avail = (len[msg[l]] - pos[l]) / SM3_BLOCK_BYTES;
+                nblocks = avail < nblocks ? avail : nblocks;
+                ++active;
+            }
+        }
+        if (active == 0) {
+            break;
+        }
+
+        const uint8_t *filler = NULL;
+        for (int l = 0; l < SM3_MB_LANES; l++) {
+            if (msg[l] < count) {
+                if (active < MB_MIN_LANES) {
+                    // not enough messages left to fill the vectors
+                    nblocks = (len[msg[l]] - pos[l]) / SM3_BLOCK_BYTES;
+                    sm3_iterate(ctx[l].V, (const uint8_t *)data[msg[l]] + pos[l], nblocks);
+                    pos[l] += nblocks * SM3_BLOCK_BYTES;
+                    ctx[l].total_len += nblocks * SM3_BLOCK_BYTES;
+                    continue;
+                }
+                V[l] = ctx[l].V;
+                buf[l] = filler = (const uint8_t *)data[msg[l]] + pos[l];
+            }
+        }
+        if (active < MB_MIN_LANES) {
+            continue;
+        }
+        for (int l = 0; l < SM3_MB_LANES; l++) {
+            if (msg[l] == count) {
+                // idle lanes hash some valid memory into a throwaway state
+                V[l] = dummy_V;
+                buf[l] = filler;
+            }
+        }
+        sm3_mb_iterate(V, buf, nblocks);
+        for (int l = 0; l < SM3_MB_LANES; l++) {
+            if (msg[l] < count) {
+                pos[l] += nblocks * SM3_BLOCK_BYTES;
+                ctx[l].total_len += nblocks * SM3_BLOCK_BYTES;
+            }
+        }
+    }
+}
+
+/*
+ * data: count messages
+ * len: size in bytes of each message
+ * count: number of messages
+ * digests: count * SM3_DIGEST_SIZE bytes, receives the hash values in the order of data
+ * function: one-shot sm3 of many messages, through the multi-buffer kernel where there is one
+ */
+void sm3_batch(const void *const *data, const size_t *len, size_t count, uint8_t *digests) {
+    sm3_ctx start;
+    sm3_init(&start);
+    sm3_batch_ctx(&start, data, len, count, digests);
+}
@@ -0,0 +1,33 @@
+#ifndef SM3_MB_H
+#define SM3_MB_H
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include "libsm3.h"
+/*
+ * This header contains declearations of the multi-buffer SM3 kernel,
+ * which runs independent messages in SIMD lanes
+ */
+#define SM3_MB_LANES 8
+// with fewer active lanes the SIMD kernel is no faster than the scalar one
+#define MB_MIN_LANES 3
+
+/*
+ * a multi-buffer kernel that sm3_mb_iterate() can run
+ * supported: checks the cpu features the kernel needs
+ */
+typedef struct {
+    const char *name;
+    void (*iterate)(uint32_t *V[SM3_MB_LANES], const uint8_t *buf[SM3_MB_LANES], size_t nblocks);
+    bool (*supported)();
+} sm3_mb_kernel;
+
+const sm3_mb_kernel *sm3_mb_kernel_list(size_t *count);
+const sm3_mb_kernel *sm3_mb_kernel_current();
+int sm3_mb_kernel_select(const char *name);
+bool sm3_mb_available();
+void sm3_mb_iterate(uint32_t *V[SM3_MB_LANES], const uint8_t *buf[SM3_MB_LANES], size_t nblocks);
+void sm3_batch_ctx(const sm3_ctx *start, const void *const *data, const size_t *len, size_t count,
+                   uint8_t *digests);
+
+#endif // SM3_MB_H
@@ -0,0 +1,437 @@
+#include <stdio.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include "libsm3.h"
+#include "file_handler.h"
+#include "sm3.h"
+#include "sm3_mb.h"
+#include "tree_hash.h"
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+/*
+ * sm3bench measures the kernels and the input paths of sm3sum and prints one
+ * JSON object per line on stdout, so that results of different releases and
+ * machines can be collected and compared by scripts:
+ *   {"bench":"info", ...}      build and machine
+ *   {"bench":"compress", ...}  one message through sm3_update(), per single-stream kernel
+ *   {"bench":"batch", ...}     sm3_batch() of BATCH_MESSAGES messages, per multi-buffer kernel
+ *   {"bench":"hmac", ...}      sm3_hmac_batch() of short messages under one key
+ *   {"bench":"files", ...}     hash_files() over a directory of files, per --io mode
+ *   {"bench":"stdin", ...}     read_and_calc() of a pipe, per --io mode
+ *   {"bench":"checklist", ...} parse_filelist() of a large check list, as -c reads it
+ * Every result has size (bytes per message or file), bytes (total hashed or parsed),
+ * seconds, gbps (1e9 bytes per second) and cycles_per_byte, which is ns_per_byte
+ * where the cpu has no cycle counter.
+ */
+
+sm3_arguments sm3_args; // the file paths take their options from here
+
+#define BENCH_BUF_SIZE (16 << 20) // large messages are streamed from a buffer of this size
+#define BATCH_MESSAGES 64
+#define PIPE_WRITE_SIZE (64 << 10)
+
+static double min_time = 0.5; // each measurement repeats for at least this long
+static size_t max_size = (size_t)1 << 30;
+static const char *bench_dir = "/tmp";
+static bool quick;
+
+static double now() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/*
+ * return: cpu cycles where the cpu can tell, nanoseconds otherwise
+ */
+static uint64_t ticks() {
+#if defined(__x86_64__) || defined(__i386__)
+	return __rdtsc();
+#else
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+#endif
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+#define TICKS_PER_BYTE "cycles_per_byte"
+#else
+#define TICKS_PER_BYTE "ns_per_byte"
+#endif
+
+/*
+ * one measurement being taken, start() it, run the code until done() says so
+ */
+typedef struct {
+	double start;
+	uint64_t start_ticks;
+	double seconds;
+	uint64_t ticks;
+	uint64_t rounds;
+} bench_timer;
+
+static void timer_start(bench_timer *t) {
+	t->rounds = 0;
+	t->start_ticks = ticks();
+	t->start = now();
+}
+
+/*
+ * function: count one more round of the measured code
+ * return: true once min_time has passed
+ */
+static bool timer_done(bench_timer *t) {
+	++t->rounds;
+	double end = now();
+	if (end - t->start < min_time) {
+		return false;
+	}
+	t->ticks = ticks() - t->start_ticks;
+	t->seconds = end - t->start;
+	return true;
+}
+
+/*
+ * function: print a result line, extra is a preformatted list of more fields or ""
+ */
+static void report(const char *bench, const char *variant, uint64_t size, uint64_t bytes,
+		double seconds, uint64_t elapsed, const char *extra) {
+	printf("{\"bench\":\"%s\",\"variant\":\"%s\",\"size\":%llu,\"bytes\":%llu,\"seconds\":%.6f,"
+	       "\"gbps\":%.4f,\"" TICKS_PER_BYTE "\":%.4f%s}\n",
+	       bench, variant, (unsigned long long)size, (unsigned long long)bytes, seconds,
+	       bytes / seconds / 1e9, (double)elapsed / bytes, extra);
+	fflush(stdout);
+}
+
+static void fill_random(uint8_t *buf, size_t len) {
+	uint64_t x = 0x9e3779b97f4a7c15ULL;
+	for (size_t i = 0; i < len; i++) {
+		x ^= x << 13;
+		x ^= x >> 7;
+		x ^= x << 17;
+		buf[i] = (uint8_t)x;
+	}
+}
+
+/*
+ * function: one message of every size from 64 B to max_size, by every single-stream kernel
+ */
+static void bench_compress(const uint8_t *buf) {
+	size_t count;
+	const sm3_kernel *kernels = sm3_kernel_list(&count);
+	const sm3_kernel *saved = sm3_kernel_current();
+	uint8_t digest[SM3_DIGEST_SIZE];
+	for (size_t k = 0; k < count; k++) {
+		if (sm3_kernel_select(kernels[k].name) != 0) {
+			continue;
+		}
+		for (size_t size = 64; size <= max_size; size <<= 4) {
+			bench_timer t;
+			timer_start(&t);
+			do {
+				sm3_ctx ctx;
+				sm3_init(&ctx);
+				for (size_t done = 0; done < size; done += BENCH_BUF_SIZE) {
+					size_t len = size - done < BENCH_BUF_SIZE ? size - done : BENCH_BUF_SIZE;
+					sm3_update(&ctx, buf, len);
+				}
+				sm3_final(&ctx, digest);
+			} while (!timer_done(&t));
+			report("compress", kernels[k].name, size, t.rounds * size, t.seconds, t.ticks, "");
+		}
+	}
+	sm3_kernel_select(saved->name);
+}
+
+/*
+ * function: BATCH_MESSAGES messages of the same size through sm3_batch(), by every
+ * multi-buffer kernel ("none" hashes them one after another)
+ */
+static void bench_batch(const uint8_t *buf) {
+	size_t count;
+	const sm3_mb_kernel *kernels = sm3_mb_kernel_list(&count);
+	const sm3_mb_kernel *saved = sm3_mb_kernel_current();
+	uint8_t digests[BATCH_MESSAGES * SM3_DIGEST_SIZE];
+	const void *data[BATCH_MESSAGES];
+	size_t len[BATCH_MESSAGES];
+	for (size_t k = 0; k < count; k++) {
+		if (sm3_mb_kernel_select(kernels[k].name) != 0) {
+			continue;
+		}
+		for (size_t size = 64; size <= BENCH_BUF_SIZE / BATCH_MESSAGES && size <= max_size; size <<= 4) {
+			for (int i = 0; i < BATCH_MESSAGES; i++) {
+				data[i] = buf + i * size;
+				len[i] = size;
+			}
+			bench_timer t;
+			timer_start(&t);
+			do {
+				sm3_batch(data, len, BATCH_MESSAGES, digests);
+			} while (!timer_done(&t));
+			report("batch", kernels[k].name, size, t.rounds * BATCH_MESSAGES * size, t.seconds, t.ticks, "");
+		}
+	}
+	sm3_mb_kernel_select(saved->name);
+}
+
+/*
+ * function: BATCH_MESSAGES short messages through sm3_hmac_batch() under one key,
+ * the way a service signing requests would use it
+ */
+static void bench_hmac(const uint8_t *buf) {
+	uint8_t macs[BATCH_MESSAGES * SM3_DIGEST_SIZE];
+	const void *data[BATCH_MESSAGES];
+	size_t len[BATCH_MESSAGES];
+	sm3_hmac_key key;
+	sm3_hmac_key_init(&key, buf, SM3_DIGEST_SIZE);
+	for (size_t size = 64; size <= 4096; size <<= 2) {
+		for (int i = 0; i < BATCH_MESSAGES; i++) {
+			data[i] = buf + i * size;
+			len[i] = size;
+		}
+		bench_timer t;
+		timer_start(&t);
+		do {
+			sm3_hmac_batch(&key, data, len, BATCH_MESSAGES, macs);
+		} while (!timer_done(&t));
+		char extra[32];
+		snprintf(extra, sizeof(extra), ",\"macs_per_s\":%.0f", t.rounds * BATCH_MESSAGES / t.seconds);
+		report("hmac", sm3_mb_kernel_current()->name, size, t.rounds * BATCH_MESSAGES * size, t.seconds,
+		       t.ticks, extra);
+	}
+}
+
+static const char *io_names[] = {"mmap", "uring", "thread"};
+
+static void no_report(sm3_file_job *job, void *arg) {
+	(void)job;
+	(void)arg;
+}
+
+/*
+ * function: create nfiles files of size bytes under bench_dir and hash them all with
+ * hash_files() on one thread per cpu, once per --io mode; the files are fresh so
+ * they come from the page cache
+ */
+static void bench_files(const uint8_t *buf, const char *name, size_t nfiles, size_t size) {
+	char dir[PATH_LIMIT];
+	snprintf(dir, sizeof(dir), "%s/sm3bench_XXXXXX", bench_dir);
+	if (mkdtemp(dir) == NULL) {
+		fprintf(stderr, "sm3bench: cannot create a directory in %s, files skipped\n", bench_dir);
+		return;
+	}
+	sm3_file_job *jobs = (sm3_file_job *)calloc(nfiles, sizeof(sm3_file_job));
+	char **paths = (char **)calloc(nfiles, sizeof(char *));
+	bool ok = true;
+	for (size_t i = 0; i < nfiles && ok; i++) {
+		size_t len = strlen(dir) + 32;
+		paths[i] = (char *)malloc(len);
+		snprintf(paths[i], len, "%s/%06zu", dir, i);
+		int fd = open(paths[i], O_WRONLY | O_CREAT | O_TRUNC, 0600);
+		ok = fd >= 0;
+		for (size_t done = 0; done < size && ok; done += BENCH_BUF_SIZE) {
+			size_t len = size - done < BENCH_BUF_SIZE ? size - done : BENCH_BUF_SIZE;
+			// every file gets different content, so nothing could be shared by accident
+			ok = write(fd, buf + i % SM3_BLOCK_BYTES, len) == (ssize_t)len;
+		}
+		if (fd >= 0) {
+			close(fd);
+		}
+	}
+	if (!ok) {
+		fprintf(stderr, "sm3bench: cannot write the files in %s, skipped\n", dir);
+	}
+
+	int threads = online_cpus();
+	char extra[64];
+	snprintf(extra, sizeof(extra), ",\"files\":%zu,\"threads\":%d", nfiles, threads);
+	for (int mode = IO_MMAP; mode <= IO_THREAD && ok; mode++) {
+		char variant[32];
+		snprintf(variant, sizeof(variant), "%s-%s", name, io_names[mode]);
+		sm3_args.io_mode = (sm3_io_mode)mode;
+		bench_timer t;
+		timer_start(&t);
+		do {
+			memset(jobs, 0, nfiles * sizeof(sm3_file_job));
+			for (size_t i = 0; i < nfiles; i++) {
+				jobs[i].file_name = paths[i];
+			}
+			hash_files(jobs, nfiles, threads, no_report, NULL);
+		} while (!timer_done(&t));
+		report("files", variant, size, t.rounds * nfiles * size, t.seconds, t.ticks, extra);
+	}
+	sm3_args.io_mode = IO_MMAP;
+
+	for (size_t i = 0; i < nfiles; i++) {
+		if (paths[i] != NULL) {
+			unlink(paths[i]);
+			free(paths[i]);
+		}
+	}
+	rmdir(dir);
+	free(paths);
+	free(jobs);
+}
+
+typedef struct {
+	int fd;
+	const uint8_t *buf;
+	size_t total;
+} pipe_writer;
+
+static void *pipe_write(void *arg) {
+	pipe_writer *w = (pipe_writer *)arg;
+	for (size_t done = 0; done < w->total; ) {
+		ssize_t n = write(w->fd, w->buf + done % BENCH_BUF_SIZE, PIPE_WRITE_SIZE);
+		if (n <= 0) {
+			break;
+		}
+		done += n;
+	}
+	close(w->fd);
+	return NULL;
+}
+
+/*
+ * function: hash total bytes written into a pipe by another thread, the way sm3sum
+ * reads stdin, once per --io mode
+ */
+static void bench_stdin(const uint8_t *buf, size_t total) {
+	uint8_t digest[SM3_DIGEST_SIZE];
+	for (int mode = IO_MMAP; mode <= IO_THREAD; mode++) {
+		sm3_args.io_mode = (sm3_io_mode)mode;
+		bench_timer t;
+		timer_start(&t);
+		do {
+			int fds[2];
+			pthread_t writer;
+			if (pipe(fds) != 0) {
+				fprintf(stderr, "sm3bench: cannot create a pipe, stdin skipped\n");
+				return;
+			}
+			pipe_writer w = {fds[1], buf, total};
+			pthread_create(&writer, NULL, pipe_write, &w);
+			FILE *fp = fdopen(fds[0], "r");
+			read_and_calc(fp, digest, NULL);
+			fclose(fp);
+			pthread_join(writer, NULL);
+		} while (!timer_done(&t));
+		report("stdin", io_names[mode], total, t.rounds * total, t.seconds, t.ticks, "");
+	}
+	sm3_args.io_mode = IO_MMAP;
+}
+
+#define CHECKLIST_ROUNDS 3
+
+/*
+ * function: load and parse a check list file of nlines GNU style lines the way -c does;
+ * the lists and pairs are kept until exit, so the number of rounds is fixed instead of timed
+ */
+static void bench_checklist(size_t nlines) {
+	const size_t max_line = 2 * SM3_DIGEST_SIZE + 32;
+	char *list = (char *)malloc(nlines * max_line + 1);
+	char *p = list;
+	for (size_t i = 0; i < nlines; i++) {
+		uint8_t digest[SM3_DIGEST_SIZE];
+		sm3(&i, sizeof(i), digest);
+		for (int j = 0; j < SM3_DIGEST_SIZE; j++) {
+			p += sprintf(p, "%02x", digest[j]);
+		}
+		p += sprintf(p, "  data/dir/file%07zu\n", i);
+	}
+	size_t size = p - list;
+	char path[PATH_LIMIT];
+	snprintf(path, sizeof(path), "%s/sm3bench_XXXXXX", bench_dir);
+	int fd = mkstemp(path);
+	bool ok = fd >= 0 && write(fd, list, size) == (ssize_t)size;
+	if (fd >= 0) {
+		close(fd);
+	}
+	free(list);
+	if (!ok) {
+		fprintf(stderr, "sm3bench: cannot write a check list in %s, skipped\n", bench_dir);
+		unlink(path);
+		return;
+	}
+
+	file_list file = {NULL, path};
+	sm3_args.check_mode = true;
+	sm3_args.head.next = &file;
+	double start = now();
+	uint64_t start_ticks = ticks();
+	for (int r = 0; r < CHECKLIST_ROUNDS; r++) {
+		parse_filelist();
+	}
+	uint64_t elapsed = ticks() - start_ticks;
+	double seconds = now() - start;
+	sm3_args.check_mode = false;
+	sm3_args.head.next = NULL;
+	unlink(path);
+
+	char extra[32];
+	snprintf(extra, sizeof(extra), ",\"lines\":%zu", nlines);
+	report("checklist", "gnu", size / nlines, CHECKLIST_ROUNDS * size, seconds, elapsed, extra);
+}
+
+static void print_help() {
+	printf("Usage: sm3bench [OPTION]...\n");
+	printf("Benchmark the SM3 kernels and the input paths of sm3sum, one JSON object per line.\n\n");
+	printf("      --quick           short runs and small sizes, for a smoke test\n");
+	printf("      --max-size=SIZE   largest message of the compress benchmark (default 1G)\n");
+	printf("      --min-time=SEC    repeat each measurement for at least SEC seconds (default 0.5)\n");
+	printf("      --dir=DIR         where the files benchmark creates its files (default /tmp)\n");
+	printf("      --help            display this help and exit\n");
+}
+
+int main(int argc, char *argv[]) {
+	for (int i = 1; i < argc; i++) {
+		if (strcmp(argv[i], "--quick") == 0) {
+			quick = true;
+			min_time = 0.05;
+			max_size = 1 << 20;
+		} else if (strncmp(argv[i], "--max-size=", 11) == 0) {
+			max_size = parse_size(argv[i] + 11);
+			if (max_size < 64) {
+				fprintf(stderr, "sm3bench: invalid size: %s\n", argv[i] + 11);
+				return 1;
+			}
+		} else if (strncmp(argv[i], "--min-time=", 11) == 0) {
+			min_time = atof(argv[i] + 11);
+		} else if (strncmp(argv[i], "--dir=", 6) == 0) {
+			bench_dir = argv[i] + 6;
+		} else if (strcmp(argv[i], "--help") == 0) {
+			print_help();
+			return 0;
+		} else {
+			fprintf(stderr, "sm3bench: unknown option %s\n", argv[i]);
+			return 1;
+		}
+	}
+	sm3_args.io_mode = IO_MMAP;
+
+	uint8_t *buf = (uint8_t *)malloc(BENCH_BUF_SIZE + SM3_BLOCK_BYTES);
+	fill_random(buf, BENCH_BUF_SIZE + SM3_BLOCK_BYTES);
+	printf("{\"bench\":\"info\",\"version\":\"%s\",\"cpus\":%d,\"kernel\":\"%s\",\"mb_kernel\":\"%s\","
+	       "\"mb_lanes\":%d,\"ticks\":\"%s\",\"quick\":%s}\n",
+	       sm3_version(), online_cpus(), sm3_kernel_current()->name, sm3_mb_kernel_current()->name,
+	       SM3_MB_LANES, TICKS_PER_BYTE, quick ? "true" : "false");
+
+	bench_compress(buf);
+	bench_batch(buf);
+	bench_hmac(buf);
+	bench_files(buf, "small", quick ? 512 : 8192, 4 << 10);
+	bench_files(buf, "large", quick ? 2 : 8, quick ? 4 << 20 : 64 << 20);
+	bench_stdin(buf, quick ? 32 << 20 : 512 << 20);
+	bench_checklist(quick ? 100000 : 1000000);
+	free(buf);
+	return 0;
+}
@@ -5,9 +5,25 @@
 #include "unit_test.h"
 #include "file_handler.h"
 #include "sm3.h"
+#include "sm3_mb.h"
+#include "tree_hash.h"
+#include "digest_cache.h"
+#include "checkpoint.h"
+#include "walk.h"
+#include "dir_digest.h"
+#include "dupes.h"
+#include "serve.h"
+#include "stats.h"
+#include "hmac.h"
+#include <sys/stat.h>
 #include <unistd.h>
+#include <time.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
 
 #define VERSION "0.1"
+#define OUTPUT_BUF_SIZE (64 << 10) // stdout buffer when it is not a terminal
 
 sm3_arguments sm3_args;
 
@@ -27,6 +43,50 @@ void print_help() {
 	printf("      --status          don't output anything, status code shows success\n");
 	printf("      --strict          exit non-zero for improperly formatted checksum lines\n");
 	printf("  -w, --warn            warn about improperly formatted checksum lines\n\n");
+	printf("  -r, --recursive       hash every regular file under the directories given\n");
+	printf("                          (default: the current directory), in sorted order\n");
+	printf("  -L, --dereference     with -r, follow symbolic links met in directories\n");
+	printf("  -x, --one-file-system with -r, skip directories on other file systems\n");
+	printf("      --tree-digest     print one SM3DIR digest for each directory given,\n");
+	printf("                          covering the names, kinds and contents of all\n");
+	printf("                          entries below it\n");
+	printf("      --manifest        with --tree-digest, print every file digest as well\n");
+	printf("      --find-duplicates print groups of files with the same contents under\n");
+	printf("                          the paths given, one file per line, groups apart\n");
+	printf("                          by an empty line; hard links count as one file\n");
+	printf("  -j, --jobs=N          hash up to N files at once (default: one per online CPU)\n");
+	printf("      --tree=CHUNK      print SM3TREE digests: CHUNK sized pieces of a file\n");
+	printf("                          (a multiple of 64, K/M/G suffixes allowed) are\n");
+	printf("                          hashed in parallel and combined into one digest;\n");
+	printf("                          this is not the SM3 of the file\n");
+	printf("      --io=MODE         how files are read: mmap (default) maps regular\n");
+	printf("                          files and pipelines the rest, uring and thread\n");
+	printf("                          always use the read pipeline with io_uring or a\n");
+	printf("                          reader thread\n");
+	printf("      --direct          read files with O_DIRECT, or drop them from the page\n");
+	printf("                          cache once hashed, so that other programs keep\n");
+	printf("                          their cached data\n");
+	printf("      --resume[=SIZE]   save the progress on a file to FILE.sm3ckpt every\n");
+	printf("                          SIZE bytes (default 256M), and go on from there\n");
+	printf("                          when an interrupted run is started again\n");
+	printf("      --cache=FILE      remember digests in FILE and reuse them for files\n");
+	printf("                          whose inode, size and timestamps are unchanged,\n");
+	printf("                          the SM3SUM_CACHE environment variable does the same\n");
+	printf("      --no-cache        do not use a digest cache\n");
+	printf("      --refresh-cache   hash every file and update its cache entry\n");
+	printf("      --serve=SOCKET    run as a hashing server on the Unix socket SOCKET\n");
+	printf("                          until SIGTERM, for --client\n");
+	printf("      --client=SOCKET   have the FILEs (or stdin) hashed by the server on\n");
+	printf("                          SOCKET, saving a process start per input\n");
+	printf("      --hmac-key-file=FILE  compute and check HMAC-SM3 instead of SM3, keyed\n");
+	printf("                          with the whole content of FILE\n");
+	printf("      --stats[=FILE]    report bytes, wall time, time spent reading and\n");
+	printf("                          hashing and throughput per file and for the run,\n");
+	printf("                          on stderr, or as JSON in FILE\n");
+	printf("      --kernel=LIST     use the comma separated compression kernels in LIST\n");
+	printf("                          instead of the fastest supported ones, the\n");
+	printf("                          SM3SUM_KERNEL environment variable does the same\n");
+	printf("      --list-kernels    list kernels with their measured speed and exit\n\n");
 	printf("      --help        display this help and exit\n");
 	printf("      --version     output version information and exit\n\n");
 	printf("The sums are computed as described in GM/T 0004-2012.\n");
@@ -37,6 +97,145 @@ void print_help() {
 	printf("Note: There is no difference between binary mode and text mode.\n");
 }
 
+/*
+ * list: comma separated kernel names, either single-stream or multi-buffer ones
+ */
+void select_kernels(const char *list) {
+	char *names = strdup(list);
+	for (char *name = strtok(names, ","); name != NULL; name = strtok(NULL, ",")) {
+		if (sm3_kernel_select(name) != 0 && sm3_mb_kernel_select(name) != 0) {
+			fprintf(stderr, "sm3sum: unknown kernel or not supported by this cpu: %s\n", name);
+			exit(1);
+		}
+	}
+	free(names);
+}
+
+/*
+ * time source for --list-kernels, cpu cycles where the cpu can tell
+ */
+static uint64_t bench_ticks() {
+#if defined(__x86_64__) || defined(__i386__)
+	return __rdtsc();
+#else
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+#endif
+}
+
+#define BENCH_BLOCKS 4096 // 256KB per lane
+#define BENCH_ROUNDS 5
+
+/*
+ * print every kernel, whether this cpu supports it, which one is selected and its speed
+ */
+void list_kernels() {
+	size_t count;
+	uint32_t V[SM3_MB_LANES][8] = {{0}};
+	uint32_t *mb_V[SM3_MB_LANES];
+	const uint8_t *mb_buf[SM3_MB_LANES];
+	uint8_t *buf = (uint8_t *)calloc(BENCH_BLOCKS, SM3_BLOCK_BYTES);
+#if defined(__x86_64__) || defined(__i386__)
+	const char *unit = "cycles/byte";
+#else
+	const char *unit = "ns/byte";
+#endif
+	for (int l = 0; l < SM3_MB_LANES; l++) {
+		mb_V[l] = V[l];
+		mb_buf[l] = buf;
+	}
+
+	const sm3_kernel *kernels = sm3_kernel_list(&count);
+	const sm3_kernel *current = sm3_kernel_current();
+	printf("single-stream kernels:\n");
+	for (size_t i = 0; i < count; i++) {
+		printf("  %c %-10s", &kernels[i] == current ? '*' : ' ', kernels[i].name);
+		if (!kernels[i].supported()) {
+			printf("not supported\n");
+			continue;
+		}
+		uint64_t best = UINT64_MAX;
+		for (int r = 0; r < BENCH_ROUNDS; r++) {
+			uint64_t start = bench_ticks();
+			kernels[i].iterate(V[0], buf, BENCH_BLOCKS);
+			uint64_t ticks = bench_ticks() - start;
+			best = ticks < best ? ticks : best;
+		}
+		printf("%6.2f %s\n", (double)best / (BENCH_BLOCKS * SM3_BLOCK_BYTES), unit);
+	}
+
+	const sm3_mb_kernel *mb_kernels = sm3_mb_kernel_list(&count);
+	const sm3_mb_kernel *mb_current = sm3_mb_kernel_current();
+	printf("multi-buffer kernels (%d lanes):\n", SM3_MB_LANES);
+	for (size_t i = 0; i < count; i++) {
+		printf("  %c %-10s", &mb_kernels[i] == mb_current ? '*' : ' ', mb_kernels[i].name);
+		if (!mb_kernels[i].supported()) {
+			printf("not supported\n");
+			continue;
+		}
+		uint64_t best = UINT64_MAX;
+		for (int r = 0; r < BENCH_ROUNDS; r++) {
+			uint64_t start = bench_ticks();
+			mb_kernels[i].iterate(mb_V, mb_buf, BENCH_BLOCKS / SM3_MB_LANES);
+			uint64_t ticks = bench_ticks() - start;
+			best = ticks < best ? ticks : best;
+		}
+		printf("%6.2f %s\n", (double)best / (BENCH_BLOCKS * SM3_BLOCK_BYTES), unit);
+	}
+	free(buf);
+}
+
+#define HMAC_KEY_READ 4096 // key files are read in pieces of this size
+
+/*
+ * path: argument of --hmac-key-file, all its bytes are the key
+ * function: a key longer than a block is replaced by its SM3 while it is read, which HMAC
+ * does anyway, so key files may be of any size
+ */
+static void load_hmac_key(const char *path) {
+	static sm3_hmac_key key;
+	uint8_t secret[HMAC_KEY_READ];
+	sm3_ctx ctx;
+	FILE *fp = fopen(path, "rb");
+	if (fp == NULL) {
+		fprintf(stderr, "sm3sum: cannot read key file %s\n", path);
+		exit(1);
+	}
+	size_t len = fread(secret, 1, sizeof(secret), fp);
+	if (len > SM3_BLOCK_BYTES) {
+		sm3_init(&ctx);
+		do {
+			sm3_update(&ctx, secret, len);
+		} while ((len = fread(secret, 1, sizeof(secret), fp)) > 0);
+		sm3_final(&ctx, secret);
+		len = SM3_DIGEST_SIZE;
+	}
+	bool ok = !ferror(fp);
+	fclose(fp);
+	if (!ok) {
+		fprintf(stderr, "sm3sum: cannot read key file %s\n", path);
+		exit(1);
+	}
+	sm3_hmac_key_init(&key, secret, len);
+	explicit_bzero(secret, sizeof(secret));
+	explicit_bzero(&ctx, sizeof(ctx));
+	sm3_args.hmac_key = &key;
+}
+
+/*
+ * value: argument of -j/--jobs, a positive number
+ */
+void parse_jobs(const char *value) {
+	char *end;
+	long jobs = strtol(value, &end, 10);
+	if (*value == 0 || *end != 0 || jobs < 1 || jobs > 4096) {
+		fprintf(stderr, "sm3sum: invalid number of jobs: %s\n", value);
+		exit(1);
+	}
+	sm3_args.jobs = (int)jobs;
+}
+
 void parse_arguments(int argc, char *argv[]) {
 	sm3_args.tail = &(sm3_args.head);
 	for (int i = 1; i < argc; i++) {
@@ -62,6 +261,78 @@ void parse_arguments(int argc, char *argv[]) {
 				sm3_args.strict = true;
 			} else if (strncmp(argv[i], "-w", 3) == 0 || strncmp(argv[i], "--warn", 7) == 0) {
 				sm3_args.warn = true;
+			} else if (strncmp(argv[i], "-r", 3) == 0 || strncmp(argv[i], "--recursive", 12) == 0) {
+				sm3_args.recursive = true;
+			} else if (strncmp(argv[i], "-L", 3) == 0 || strncmp(argv[i], "--dereference", 14) == 0) {
+				sm3_args.follow_symlinks = true;
+			} else if (strncmp(argv[i], "-x", 3) == 0 || strncmp(argv[i], "--one-file-system", 18) == 0) {
+				sm3_args.one_file_system = true;
+			} else if (strncmp(argv[i], "--tree-digest", 14) == 0) {
+				sm3_args.tree_digest = true;
+			} else if (strncmp(argv[i], "--manifest", 11) == 0) {
+				sm3_args.manifest = true;
+			} else if (strncmp(argv[i], "--find-duplicates", 18) == 0) {
+				sm3_args.find_duplicates = true;
+			} else if (strncmp(argv[i], "-j", 3) == 0 || strncmp(argv[i], "--jobs", 7) == 0) {
+				if (i + 1 >= argc) {
+					fprintf(stderr, "sm3sum: option '%s' requires an argument\n", argv[i]);
+					exit(1);
+				}
+				parse_jobs(argv[++i]);
+			} else if (strncmp(argv[i], "--jobs=", 7) == 0) {
+				parse_jobs(argv[i] + 7);
+			} else if (strncmp(argv[i], "-j", 2) == 0) {
+				// -jN
+				parse_jobs(argv[i] + 2);
+			} else if (strncmp(argv[i], "--tree=", 7) == 0) {
+				sm3_args.tree_chunk = parse_size(argv[i] + 7);
+				if (sm3_args.tree_chunk == 0 || sm3_args.tree_chunk % SM3_BLOCK_BYTES != 0) {
+					fprintf(stderr, "sm3sum: invalid tree chunk size: %s\n", argv[i] + 7);
+					exit(1);
+				}
+			} else if (strncmp(argv[i], "--io=", 5) == 0) {
+				if (strcmp(argv[i] + 5, "mmap") == 0) {
+					sm3_args.io_mode = IO_MMAP;
+				} else if (strcmp(argv[i] + 5, "uring") == 0) {
+					sm3_args.io_mode = IO_URING;
+				} else if (strcmp(argv[i] + 5, "thread") == 0) {
+					sm3_args.io_mode = IO_THREAD;
+				} else {
+					fprintf(stderr, "sm3sum: invalid io mode: %s\n", argv[i] + 5);
+					exit(1);
+				}
+			} else if (strncmp(argv[i], "--direct", 9) == 0) {
+				sm3_args.direct = true;
+			} else if (strncmp(argv[i], "--resume", 9) == 0) {
+				sm3_args.resume_interval = CHECKPOINT_INTERVAL;
+			} else if (strncmp(argv[i], "--resume=", 9) == 0) {
+				sm3_args.resume_interval = parse_size(argv[i] + 9);
+				if (sm3_args.resume_interval == 0) {
+					fprintf(stderr, "sm3sum: invalid checkpoint interval: %s\n", argv[i] + 9);
+					exit(1);
+				}
+			} else if (strncmp(argv[i], "--hmac-key-file=", 16) == 0) {
+				load_hmac_key(argv[i] + 16);
+			} else if (strncmp(argv[i], "--stats", 8) == 0) {
+				sm3_args.stats = true;
+			} else if (strncmp(argv[i], "--stats=", 8) == 0) {
+				sm3_args.stats = true;
+				sm3_args.stats_file = argv[i] + 8;
+			} else if (strncmp(argv[i], "--cache=", 8) == 0) {
+				sm3_args.cache_file = argv[i] + 8;
+			} else if (strncmp(argv[i], "--serve=", 8) == 0) {
+				sm3_args.serve_socket = argv[i] + 8;
+			} else if (strncmp(argv[i], "--client=", 9) == 0) {
+				sm3_args.client_socket = argv[i] + 9;
+			} else if (strncmp(argv[i], "--no-cache", 11) == 0) {
+				sm3_args.cache_file = NULL;
+			} else if (strncmp(argv[i], "--refresh-cache", 16) == 0) {
+				sm3_args.refresh_cache = true;
+			} else if (strncmp(argv[i], "--kernel=", 9) == 0) {
+				select_kernels(argv[i] + 9);
+			} else if (strncmp(argv[i], "--list-kernels", 15) == 0) {
+				list_kernels();
+				exit(0);
 			} else if (strncmp(argv[i], "--help", 7) == 0) {
 				print_help();
 				exit(0);
@@ -82,80 +353,381 @@ void parse_arguments(int argc, char *argv[]) {
 	}
 }
 
+/*
+ * report of check(), jobs arrive in the order of the check list
+ */
+static void check_report(sm3_file_job *job, void *arg) {
+	int *fail_count = (int *)arg;
+	file_sm3_pair *pair = (file_sm3_pair *)job->priv;
+	if (job->failed) {
+		// cannot read file
+		printf("Cannot access file %s, either non-existing or not readable\n", job->file_name);
+	} else if (memcmp(pair->expected_sm3, job->digest, SM3_DIGEST_SIZE) == 0) {
+		printf("%s: OK\n", job->file_name);
+	} else {
+		printf("%s: FAILED\n", job->file_name);
+		++*fail_count;
+	}
+}
+
 /*
  * calculate hash for every file specified
  * only read from the list with head hash_pair_head
  */
 void check() {
-	FILE *target_file;
-	size_t file_size;
-	file_sm3_pair *file_ptr = hash_pair_head.next;
+	size_t count = 0;
 	int fail_count = 0;
-	while (file_ptr != NULL) {
-		if (1/*access(file_ptr->file_name, R_OK)*/) {
-			// we are able to read from this file
-			target_file = fopen(file_ptr->file_name, "r");
-			// todo: handle read data
-			file_size = get_file_size(file_ptr->file_name) * 8;
-			read_and_calc(target_file, file_size);
-			fclose(target_file);
-			if (memcmp(file_ptr->expected_sm3, V, 256/8) == 0) {
-				printf("%s: OK\n", file_ptr->file_name);
-			} else {
-				printf("%s: FAILED\n", file_ptr->file_name);
-				++fail_count;
+	for (file_sm3_pair *file_ptr = hash_pair_head.next; file_ptr != NULL; file_ptr = file_ptr->next) {
+		++count;
+	}
+	sm3_file_job *jobs = (sm3_file_job *)calloc(count, sizeof(sm3_file_job));
+	count = 0;
+	for (file_sm3_pair *file_ptr = hash_pair_head.next; file_ptr != NULL; file_ptr = file_ptr->next) {
+		jobs[count].file_name = file_ptr->file_name;
+		jobs[count].tree_chunk = file_ptr->tree_chunk;
+		jobs[count].priv = file_ptr;
+		++count;
+	}
+	hash_files(jobs, count, sm3_args.jobs, check_report, &fail_count);
+	free(jobs);
+	if (fail_count > 0) {
+		printf("sm3sum: WARNING: %d computed checksums did NOT match\n", fail_count);
+	}
+}
+
+/*
+ * function: print an SM3TREE result, always tagged so that -c can tell it from plain SM3
+ */
+static void tree_print(const uint8_t *digest, const char *file_name, size_t chunk) {
+	char tag[sizeof(TREE_TAG) + 20];
+	snprintf(tag, sizeof(tag), TREE_TAG "%zu", chunk);
+	digest_line(tag, digest, file_name);
+}
+
+/*
+ * report of output(), jobs arrive in the order of the command line
+ */
+static void output_report(sm3_file_job *job, void *arg) {
+	(void)arg;
+	if (job->failed) {
+		printf("Cannot access file %s, either non-existing or not readable\n", job->file_name);
+	} else if (job->tree_chunk != 0) {
+		tree_print(job->digest, job->file_name, job->tree_chunk);
+	} else {
+		sm3_print(job->digest, job->file_name);
+	}
+}
+
+/*
+ * names: the paths given, count entries
+ * function: --tree-digest, an SM3DIR line for every directory, the usual line for anything else
+ */
+static void dir_output(char **names, size_t count) {
+	uint8_t digest[SM3_DIGEST_SIZE];
+	sm3_file_job *jobs = (sm3_file_job *)calloc(count + 1, sizeof(sm3_file_job));
+	size_t pending = 0;
+	for (size_t i = 0; i <= count; i++) {
+		struct stat st;
+		bool is_dir = i < count && stat(names[i], &st) == 0 && S_ISDIR(st.st_mode);
+		if (i < count && !is_dir) {
+			jobs[pending].tree_chunk = sm3_args.tree_chunk;
+			jobs[pending++].file_name = names[i];
+			continue;
+		}
+		// files given before this directory keep their place in the output
+		hash_files(jobs, pending, sm3_args.jobs, output_report, NULL);
+		memset(jobs, 0, pending * sizeof(sm3_file_job));
+		pending = 0;
+		if (i == count) {
+			break;
+		}
+		if (dir_digest(names[i], sm3_args.jobs, sm3_args.manifest ? output_report : NULL, NULL, digest) != 0) {
+			printf("Cannot access file %s, either non-existing or not readable\n", names[i]);
+			continue;
+		}
+		digest_line(DIR_TAG, digest, names[i]);
+	}
+	free(jobs);
+}
+
+/*
+ * return: all of stdin in a malloc()ed buffer of *len bytes, NULL if it is longer than a batch
+ */
+static uint8_t *read_stdin(size_t *len) {
+	size_t size = 1 << 16;
+	uint8_t *buf = (uint8_t *)malloc(size);
+	*len = 0;
+	while (buf != NULL) {
+		size_t got = fread(buf + *len, 1, size - *len, stdin);
+		*len += got;
+		if (got == 0) {
+			break;
+		}
+		if (*len == size) {
+			if (size >= SERVE_BATCH_BYTES) {
+				free(buf);
+				return NULL;
+			}
+			size *= 2;
+			uint8_t *grown = (uint8_t *)realloc(buf, size);
+			if (grown == NULL) {
+				free(buf);
 			}
+			buf = grown;
+		}
+	}
+	if (buf == NULL || ferror(stdin)) {
+		free(buf);
+		return NULL;
+	}
+	return buf;
+}
+
+/*
+ * names: the files to have hashed by the server of --client, count entries, stdin when there are none
+ * function: send them in batches as absolute paths and print the usual lines with the names given
+ */
+static void client_output(char **names, size_t count) {
+	int fd = serve_connect(sm3_args.client_socket);
+	if (fd < 0) {
+		fprintf(stderr, "sm3sum: cannot connect to %s\n", sm3_args.client_socket);
+		exit(1);
+	}
+	size_t batch = count < SERVE_BATCH_MAX ? count : SERVE_BATCH_MAX;
+	serve_request *requests = (serve_request *)calloc(batch + 1, sizeof(serve_request));
+	char **paths = (char **)calloc(batch + 1, sizeof(char *));
+	uint8_t *digests = (uint8_t *)malloc((batch + 1) * SM3_DIGEST_SIZE);
+	bool *failed = (bool *)calloc(batch + 1, sizeof(bool));
+	if (requests == NULL || paths == NULL || digests == NULL || failed == NULL) {
+		fprintf(stderr, "sm3sum: out of memory\n");
+		exit(1);
+	}
+	if (count == 0) {
+		// the bytes themselves go to the server
+		size_t len;
+		uint8_t *data = read_stdin(&len);
+		requests[0].kind = SERVE_DATA;
+		requests[0].data = data;
+		requests[0].len = len;
+		if (data == NULL || serve_call(fd, requests, 1, digests, failed) != 0 || failed[0]) {
+			printf("Cannot access file -, either non-existing or not readable\n");
 		} else {
-			// cannot read file
-			printf("Cannot access file %s, either non-existing or not readable\n", file_ptr->file_name);
+			sm3_print(digests, "-");
 		}
-		file_ptr = file_ptr->next;
+		free(data);
 	}
-	if (fail_count > 0) {
-		printf("sm3sum: WARNING: %d computed checksums did NOT match\n", fail_count);
+	for (size_t i = 0; i < count;) {
+		size_t n = 0, bytes = 0;
+		while (i + n < count && n < SERVE_BATCH_MAX) {
+			// the server has a working directory of its own
+			char *path = realpath(names[i + n], NULL);
+			size_t len = strlen(path != NULL ? path : names[i + n]);
+			if (n > 0 && bytes + len > SERVE_BATCH_BYTES) {
+				free(path);
+				break;
+			}
+			paths[n] = path;
+			requests[n].kind = SERVE_PATH;
+			requests[n].data = path != NULL ? path : names[i + n];
+			requests[n].len = len;
+			bytes += len;
+			++n;
+		}
+		if (serve_call(fd, requests, n, digests, failed) != 0) {
+			fprintf(stderr, "sm3sum: lost the connection to %s\n", sm3_args.client_socket);
+			exit(1);
+		}
+		for (size_t j = 0; j < n; j++) {
+			if (failed[j]) {
+				printf("Cannot access file %s, either non-existing or not readable\n", names[i + j]);
+			} else {
+				sm3_print(digests + j * SM3_DIGEST_SIZE, names[i + j]);
+			}
+			free(paths[j]);
+		}
+		i += n;
 	}
+	close(fd);
+	free(requests);
+	free(paths);
+	free(digests);
+	free(failed);
 }
 
 void output() {
-	FILE *target_file;
-	size_t file_size;
+	uint8_t digest[SM3_DIGEST_SIZE];
 	file_list *file_ptr = sm3_args.head.next;
-	if (file_ptr == NULL) {
+	sm3_io_stats stats = {0, 0, 0, 0};
+	uint64_t start = sm3_args.stats ? stats_clock() : 0;
+	if (file_ptr == NULL && sm3_args.tree_chunk != 0) {
+		bool failed = tree_hash_fd(STDIN_FILENO, sm3_args.tree_chunk, sm3_args.jobs, digest) != 0;
+		if (sm3_args.stats) {
+			stats.wall_ns = stats_clock() - start;
+			stats_record("-", &stats, false, failed);
+		}
+		if (failed) {
+			printf("Cannot access file -, either non-existing or not readable\n");
+		} else {
+			tree_print(digest, "-", sm3_args.tree_chunk);
+		}
+	} else if (file_ptr == NULL && sm3_args.client_socket != NULL) {
+		client_output(NULL, 0);
+	} else if (file_ptr == NULL) {
 		// read from stdin
-		stdin_read_and_calc();
-		sm3_print("-");
+		bool failed = stdin_read_and_calc(digest, sm3_args.stats ? &stats : NULL) != 0;
+		if (sm3_args.stats) {
+			stats.wall_ns = stats_clock() - start;
+			stats_record("-", &stats, false, failed);
+		}
+		if (failed) {
+			printf("Cannot access file -, either non-existing or not readable\n");
+		} else {
+			sm3_print(digest, "-");
+		}
 	} else {
-		while (file_ptr != NULL) {
-			if (1 /*access(file_ptr->file_name, F_OK)*/) {
-				// we are able to read from this file
-				target_file = fopen(file_ptr->file_name, "r");
-				if (target_file == NULL) continue;
-				// file size in bits
-				file_size = get_file_size(file_ptr->file_name) * 8;
-				// todo: output results
-				read_and_calc(target_file, file_size);
-				fclose(target_file);
-				sm3_print(file_ptr->file_name);
-				file_ptr = file_ptr->next;
-			}
+		size_t count = 0;
+		for (; file_ptr != NULL; file_ptr = file_ptr->next) {
+			++count;
+		}
+		char **names = (char **)malloc((count + 1) * sizeof(char *));
+		count = 0;
+		for (file_ptr = sm3_args.head.next; file_ptr != NULL; file_ptr = file_ptr->next) {
+			names[count++] = file_ptr->file_name;
+		}
+		if (sm3_args.tree_digest) {
+			dir_output(names, count);
+			free(names);
+			return;
+		}
+		if (sm3_args.recursive || sm3_args.find_duplicates) {
+			// checkpoints of files left behind by --resume are not files to hash
+			walk_options options = {sm3_args.follow_symlinks, sm3_args.one_file_system, false,
+			                        sm3_args.resume_interval != 0 ? CHECKPOINT_SUFFIX : NULL};
+			char **roots = names;
+			names = walk_paths(roots, count, sm3_args.jobs, &options, &count, NULL);
+			free(roots);
+		}
+		if (sm3_args.client_socket != NULL) {
+			client_output(names, count);
+			free(names);
+			return;
+		}
+		if (sm3_args.find_duplicates) {
+			find_duplicates(names, count, sm3_args.jobs);
+			free(names);
+			return;
 		}
+		sm3_file_job *jobs = (sm3_file_job *)calloc(count, sizeof(sm3_file_job));
+		for (size_t i = 0; i < count; i++) {
+			jobs[i].tree_chunk = sm3_args.tree_chunk;
+			jobs[i].file_name = names[i];
+		}
+		hash_files(jobs, count, sm3_args.jobs, output_report, NULL);
+		free(jobs);
+		free(names);
 	}
-	
 }
 
 int main(int argc, char *argv[]) {
+	char *kernel_env = getenv("SM3SUM_KERNEL");
+	if (kernel_env != NULL) {
+		// command line options come later and take precedence
+		select_kernels(kernel_env);
+	}
+	char *cache_env = getenv(CACHE_ENV);
+	if (cache_env != NULL && *cache_env != 0) {
+		sm3_args.cache_file = cache_env;
+	}
 	parse_arguments(argc, argv);
+	if (!isatty(STDOUT_FILENO)) {
+		// digest lines leave in OUTPUT_BUF_SIZE writes, a terminal still sees them line by line
+		setvbuf(stdout, NULL, _IOFBF, OUTPUT_BUF_SIZE);
+	}
+	if (sm3_args.jobs == 0) {
+		sm3_args.jobs = online_cpus();
+	}
+	if (sm3_args.hmac_key != NULL && (sm3_args.tree_chunk != 0 || sm3_args.tree_digest || sm3_args.resume_interval != 0 ||
+		sm3_args.find_duplicates)) {
+		// SM3TREE and SM3DIR are digests of digests, checkpoints would keep keyed state on disk,
+		// --find-duplicates finishes short files with plain SM3 prefixes
+		fprintf(stderr, "sm3sum: --hmac-key-file cannot be combined with --tree, --tree-digest, --resume or "
+				"--find-duplicates\n");
+		exit(1);
+	}
+	if (sm3_args.tree_digest && sm3_args.tree_chunk != 0) {
+		// the manifest holds plain SM3 digests, SM3TREE ones would make another digest
+		fprintf(stderr, "sm3sum: --tree-digest cannot be combined with --tree\n");
+		exit(1);
+	}
+	if (sm3_args.find_duplicates && (sm3_args.tree_chunk != 0 || sm3_args.tree_digest)) {
+		// duplicates are told by the SM3 of their contents
+		fprintf(stderr, "sm3sum: --find-duplicates cannot be combined with --tree or --tree-digest\n");
+		exit(1);
+	}
+	if ((sm3_args.serve_socket != NULL || sm3_args.client_socket != NULL) && serve_conflict() != NULL) {
+		fprintf(stderr, "sm3sum: --serve and --client cannot be combined with %s\n", serve_conflict());
+		exit(1);
+	}
+	if (sm3_args.serve_socket != NULL) {
+		if (sm3_args.head.next != NULL || sm3_args.client_socket != NULL) {
+			fprintf(stderr, "sm3sum: --serve takes no FILE\n");
+			exit(1);
+		}
+		return serve(sm3_args.serve_socket) != 0;
+	}
+	if ((sm3_args.recursive || sm3_args.tree_digest || sm3_args.find_duplicates) && !sm3_args.check_mode &&
+		sm3_args.head.next == NULL) {
+		// -r, --tree-digest or --find-duplicates without a path takes the current directory instead of stdin
+		static file_list here = {NULL, "."};
+		sm3_args.head.next = &here;
+	}
+	if (sm3_args.stats) {
+		stats_begin(sm3_args.stats_file);
+	}
 	parse_filelist();
 	if (sm3_args.check_mode) {
 		check();
 	} else {
 		output();
 	}
+	if (sm3_args.stats && stats_end() != 0) {
+		fprintf(stderr, "sm3sum: cannot write statistics to %s\n", sm3_args.stats_file);
+	}
 	/*
 	printf("sm3 of 'abc':\n");
     sm3_padding_test();
 	printf("sm3 of second example of SM3:\n");
 	sm3_block_ext_test();
+	printf("sm3 streaming update test\n");
+	sm3_stream_test();
+	printf("sm3 compression kernel test\n");
+	sm3_kernel_test();
+	printf("sm3 multi-buffer kernel test\n");
+	sm3_mb_test();
+	printf("sm3 batch test\n");
+	sm3_batch_test();
+	printf("sm3 hmac test\n");
+	sm3_hmac_test();
+	printf("sm3 tree hash test\n");
+	sm3_tree_test();
+	printf("sm3 read pipeline test\n");
+	sm3_pipeline_test();
+	printf("sm3 sparse file test\n");
+	sm3_sparse_test();
+	printf("sm3 digest cache test\n");
+	sm3_cache_test();
+	printf("sm3 checkpoint test\n");
+	sm3_checkpoint_test();
+	printf("sm3 directory walk test\n");
+	sm3_walk_test();
+	printf("sm3 directory digest test\n");
+	sm3_dir_digest_test();
+	printf("sm3 duplicate finder test\n");
+	sm3_dupes_test();
+	printf("sm3 hashing server test\n");
+	sm3_serve_test();
+	printf("sm3 hex output test\n");
+	sm3_hex_test();
 	printf("sm3 argument chceklist parse test\n");
 	sm3_parse_checklist_test();
 	printf("sm3 argument filelist parse test\n");
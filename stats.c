@@ -0,0 +1,161 @@
+#include "stats.h"
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+/*
+ * --stats prints a line per input and a summary on stderr, --stats=FILE writes
+ * the same as one JSON object instead:
+ *   {"files":[{"name":...,"status":"hashed"|"cached"|"failed","bytes":...,"wall_ns":...,
+ *              "read_ns":...,"hash_ns":...,"mb_per_s":...}, ...],
+ *    "total":{"files":...,"hashed":...,"cached":...,"failed":...,"bytes":...,"wall_ns":...,
+ *             "read_ns":...,"hash_ns":...,"mb_per_s":...}}
+ * Inputs arrive in output order from the reporting thread, so nothing here is locked.
+ * The total wall time is that of the whole run, the read and hash times are summed
+ * over all inputs and can exceed it when several threads hash.
+ */
+
+static struct {
+    FILE *json; // NULL for text on stderr
+    uint64_t start;
+    size_t files, hashed, cached, failed;
+    uint64_t bytes, read_ns, hash_ns;
+} run;
+
+static double mb_per_s(uint64_t bytes, uint64_t ns) {
+    return ns == 0 ? 0 : bytes * 1e3 / ns;
+}
+
+/*
+ * return: length of the well-formed UTF-8 sequence at p, 0 if there is none
+ */
+static size_t utf8_length(const unsigned char *p) {
+    size_t len;
+    uint32_t c;
+    if (p[0] < 0xc2 || p[0] > 0xf4) {
+        return 0;
+    } else if (p[0] < 0xe0) {
+        len = 2;
+        c = p[0] & 0x1f;
+    } else if (p[0] < 0xf0) {
+        len = 3;
+        c = p[0] & 0x0f;
+    } else {
+        len = 4;
+        c = p[0] & 0x07;
+    }
+    for (size_t i = 1; i < len; i++) {
+        if ((p[i] & 0xc0) != 0x80) {
+            return 0;
+        }
+        c = c << 6 | (p[i] & 0x3f);
+    }
+    // overlong forms, surrogates and code points past U+10FFFF
+    if ((len == 3 && c < 0x800) || (len == 4 && c < 0x10000) || (c >= 0xd800 && c < 0xe000) || c > 0x10ffff) {
+        return 0;
+    }
+    return len;
+}
+
+/*
+ * function: write str as a JSON string, file names may hold anything; UTF-8 is kept,
+ * a byte that is not part of it is written as the code point of the same value
+ */
+static void json_string(FILE *fp, const char *str) {
+    fputc('"', fp);
+    for (const unsigned char *p = (const unsigned char *)str; *p != 0; p++) {
+        size_t len;
+        if (*p == '"' || *p == '\\') {
+            fprintf(fp, "\\%c", *p);
+        } else if (*p < 0x20 || *p == 0x7f) {
+            fprintf(fp, "\\u%04x", *p);
+        } else if (*p < 0x80) {
+            fputc(*p, fp);
+        } else if ((len = utf8_length(p)) != 0) {
+            fwrite(p, 1, len, fp);
+            p += len - 1;
+        } else {
+            fprintf(fp, "\\u%04x", *p);
+        }
+    }
+    fputc('"', fp);
+}
+
+/*
+ * json_file: where the JSON goes, NULL for text on stderr
+ * function: start timing the run
+ */
+void stats_begin(const char *json_file) {
+    memset(&run, 0, sizeof(run));
+    if (json_file != NULL) {
+        run.json = fopen(json_file, "w");
+        if (run.json == NULL) {
+            fprintf(stderr, "sm3sum: cannot write statistics to %s\n", json_file);
+            exit(1);
+        }
+        fputs("{\"files\":[", run.json);
+    }
+    run.start = stats_clock();
+}
+
+/*
+ * name: the input, "-" for stdin
+ * stats: what hashing it took, ignored for cached and failed inputs
+ * cached: answered by the digest cache
+ * failed: could not be opened or read
+ */
+void stats_record(const char *name, const sm3_io_stats *stats, bool cached, bool failed) {
+    const char *status = failed ? "failed" : cached ? "cached" : "hashed";
+    sm3_io_stats none = {0, 0, 0, 0};
+    if (failed || cached) {
+        stats = &none;
+    }
+    ++run.files;
+    run.failed += failed;
+    run.cached += cached && !failed;
+    run.hashed += !cached && !failed;
+    run.bytes += stats->bytes;
+    run.read_ns += stats->read_ns;
+    run.hash_ns += stats->hash_ns;
+
+    if (run.json == NULL) {
+        if (failed || cached) {
+            fprintf(stderr, "sm3sum: stats: %s: %s\n", name, status);
+            return;
+        }
+        fprintf(stderr, "sm3sum: stats: %s: %llu bytes in %.3f ms (read %.3f ms, hash %.3f ms), %.1f MB/s\n",
+                name, (unsigned long long)stats->bytes, stats->wall_ns / 1e6, stats->read_ns / 1e6,
+                stats->hash_ns / 1e6, mb_per_s(stats->bytes, stats->wall_ns));
+        return;
+    }
+    fputs(run.files > 1 ? ",\n{\"name\":" : "\n{\"name\":", run.json);
+    json_string(run.json, name);
+    fprintf(run.json, ",\"status\":\"%s\",\"bytes\":%llu,\"wall_ns\":%llu,\"read_ns\":%llu,\"hash_ns\":%llu,"
+            "\"mb_per_s\":%.1f}", status, (unsigned long long)stats->bytes, (unsigned long long)stats->wall_ns,
+            (unsigned long long)stats->read_ns, (unsigned long long)stats->hash_ns,
+            mb_per_s(stats->bytes, stats->wall_ns));
+}
+
+/*
+ * function: print the summary of the run
+ * return: 0 on success, -1 if the JSON file could not be written
+ */
+int stats_end() {
+    uint64_t wall_ns = stats_clock() - run.start;
+    if (run.json == NULL) {
+        fprintf(stderr, "sm3sum: stats: total: %zu files (%zu hashed, %zu from cache, %zu failed), "
+                "%llu bytes in %.3f s (read %.3f s, hash %.3f s), %.1f MB/s\n",
+                run.files, run.hashed, run.cached, run.failed, (unsigned long long)run.bytes, wall_ns / 1e9,
+                run.read_ns / 1e9, run.hash_ns / 1e9, mb_per_s(run.bytes, wall_ns));
+        return 0;
+    }
+    fprintf(run.json, "\n],\"total\":{\"files\":%zu,\"hashed\":%zu,\"cached\":%zu,\"failed\":%zu,\"bytes\":%llu,"
+            "\"wall_ns\":%llu,\"read_ns\":%llu,\"hash_ns\":%llu,\"mb_per_s\":%.1f}}\n",
+            run.files, run.hashed, run.cached, run.failed, (unsigned long long)run.bytes,
+            (unsigned long long)wall_ns, (unsigned long long)run.read_ns, (unsigned long long)run.hash_ns,
+            mb_per_s(run.bytes, wall_ns));
+    return fclose(run.json) == 0 ? 0 : -1;
+}
@@ -0,0 +1,36 @@
+#ifndef STATS_H
+#define STATS_H
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <time.h>
+/*
+ * This header contains declearations of --stats, which tells where the time
+ * of a run went: reading, compressing, or answered by the digest cache
+ */
+
+/*
+ * time and bytes spent on one input, all times in nanoseconds
+ * read_ns: blocked waiting for data; mapped files fault their pages in while
+ * being hashed, so their reading counts as hash_ns
+ * hash_ns: in the compression function
+ * read_ns and hash_ns are 0 for SM3TREE files, whose chunks are read and hashed by several threads
+ */
+typedef struct {
+    uint64_t bytes; // bytes hashed
+    uint64_t wall_ns; // from opening the input to its digest
+    uint64_t read_ns;
+    uint64_t hash_ns;
+} sm3_io_stats;
+
+static inline uint64_t stats_clock() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+void stats_begin(const char *json_file);
+void stats_record(const char *name, const sm3_io_stats *stats, bool cached, bool failed);
+int stats_end();
+
+#endif // STATS_H
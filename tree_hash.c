@@ -0,0 +1,198 @@
+#include "tree_hash.h"
+#include "sm3.h"
+#include <stdint.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+
+/*
+ * SM3TREE with chunk size C over a message M of L bytes:
+ *   leaf_i = SM3(M[i * C, (i + 1) * C)), i = 0 .. ceil(L / C) - 1
+ *   root   = SM3("SM3TREE" 0x00 || be64(C) || be64(L) || leaf_0 || leaf_1 || ...)
+ * C and L in the root fix where every chunk starts, so equal roots mean equal messages
+ * unless SM3 itself collides. An empty message has no leaves.
+ */
+
+#define TREE_READ_SIZE (1 << 20) // chunks are read in pieces of at most this size
+#define CACHE_LINE 64
+
+extern sm3_arguments sm3_args;
+
+typedef struct {
+    int fd;
+    size_t chunk;
+    uint64_t file_size;
+    size_t nchunks;
+    uint8_t *leaves;
+    bool failed;
+    size_t next __attribute__((aligned(CACHE_LINE)));
+} tree_job;
+
+/*
+ * function: hash chunk by chunk with pread until no chunk is left
+ */
+static void *tree_worker(void *arg) {
+    tree_job *tree = (tree_job *)arg;
+    size_t buf_size = tree->chunk < TREE_READ_SIZE ? tree->chunk : TREE_READ_SIZE;
+    uint8_t *buf = (uint8_t *)malloc(buf_size);
+    size_t i;
+    while ((i = __atomic_fetch_add(&tree->next, 1, __ATOMIC_RELAXED)) < tree->nchunks) {
+        uint64_t offset = (uint64_t)i * tree->chunk;
+        uint64_t end = offset + tree->chunk < tree->file_size ? offset + tree->chunk : tree->file_size;
+        sm3_ctx ctx;
+        sm3_init(&ctx);
+        while (offset < end) {
+            size_t want = end - offset < buf_size ? end - offset : buf_size;
+            ssize_t got = pread(tree->fd, buf, want, offset);
+            if (got < 0 && errno == EINTR) {
+                continue;
+            }
+            if (got <= 0) {
+                // truncated under us or unreadable
+                __atomic_store_n(&tree->failed, true, __ATOMIC_RELAXED);
+                break;
+            }
+            sm3_update(&ctx, buf, got);
+            offset += got;
+        }
+        if (sm3_args.direct) {
+            // chunks need not be aligned for O_DIRECT, drop each one once it is hashed instead
+            posix_fadvise(tree->fd, (off_t)i * tree->chunk, offset - (uint64_t)i * tree->chunk, POSIX_FADV_DONTNEED);
+        }
+        sm3_final(&ctx, tree->leaves + i * SM3_DIGEST_SIZE);
+    }
+    free(buf);
+    return NULL;
+}
+
+/*
+ * function: combine the leaves into the root digest
+ */
+static void tree_root(size_t chunk, uint64_t file_size, const uint8_t *leaves, size_t nchunks, uint8_t *digest) {
+    uint64_t chunk_be = local_to_be(chunk);
+    uint64_t size_be = local_to_be(file_size);
+    sm3_ctx ctx;
+    sm3_init(&ctx);
+    sm3_update(&ctx, TREE_MAGIC, sizeof(TREE_MAGIC)); // with its terminating 0
+    sm3_update(&ctx, &chunk_be, sizeof(chunk_be));
+    sm3_update(&ctx, &size_be, sizeof(size_be));
+    sm3_update(&ctx, leaves, nchunks * SM3_DIGEST_SIZE);
+    sm3_final(&ctx, digest);
+}
+
+/*
+ * function: tree hash of a stream that cannot be read at random offsets, one chunk after another
+ */
+static int tree_hash_stream(int fd, size_t chunk, uint8_t *digest) {
+    size_t buf_size = chunk < TREE_READ_SIZE ? chunk : TREE_READ_SIZE;
+    uint8_t *buf = (uint8_t *)malloc(buf_size);
+    uint8_t *leaves = NULL;
+    size_t nchunks = 0, in_chunk = 0;
+    uint64_t total = 0;
+    sm3_ctx ctx;
+    int ret = 0;
+    sm3_init(&ctx);
+    while (true) {
+        size_t want = chunk - in_chunk < buf_size ? chunk - in_chunk : buf_size;
+        ssize_t got = read(fd, buf, want);
+        if (got < 0 && errno == EINTR) {
+            continue;
+        }
+        if (got < 0) {
+            ret = -1;
+            break;
+        }
+        if (got > 0) {
+            sm3_update(&ctx, buf, got);
+            in_chunk += got;
+            total += got;
+        }
+        if (in_chunk == chunk || (got == 0 && in_chunk > 0)) {
+            leaves = (uint8_t *)realloc(leaves, (nchunks + 1) * SM3_DIGEST_SIZE);
+            sm3_final(&ctx, leaves + nchunks * SM3_DIGEST_SIZE);
+            ++nchunks;
+            in_chunk = 0;
+            sm3_init(&ctx);
+        }
+        if (got == 0) {
+            break;
+        }
+    }
+    tree_root(chunk, total, leaves, nchunks, digest);
+    free(leaves);
+    free(buf);
+    return ret;
+}
+
+/*
+ * fd: file to hash, read from its current offset for streams and from 0 for regular files
+ * chunk: chunk size in bytes
+ * threads: number of threads hashing chunks of a regular file
+ * digest: at least SM3_DIGEST_SIZE bytes, receives the root digest
+ * return: 0 on success, -1 if the file could not be read
+ */
+int tree_hash_fd(int fd, size_t chunk, int threads, uint8_t *digest) {
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        return -1;
+    }
+    if (!S_ISREG(st.st_mode)) {
+        return tree_hash_stream(fd, chunk, digest);
+    }
+
+    tree_job tree;
+    memset(&tree, 0, sizeof(tree));
+    tree.fd = fd;
+    tree.chunk = chunk;
+    tree.file_size = st.st_size;
+    tree.nchunks = (st.st_size + chunk - 1) / chunk;
+    tree.leaves = (uint8_t *)malloc(tree.nchunks * SM3_DIGEST_SIZE + 1);
+    if (threads > (int)tree.nchunks) {
+        threads = (int)tree.nchunks;
+    }
+    if (threads <= 1) {
+        tree_worker(&tree);
+    } else {
+        pthread_t *workers = (pthread_t *)malloc(threads * sizeof(pthread_t));
+        for (int t = 0; t < threads; t++) {
+            pthread_create(&workers[t], NULL, tree_worker, &tree);
+        }
+        for (int t = 0; t < threads; t++) {
+            pthread_join(workers[t], NULL);
+        }
+        free(workers);
+    }
+    tree_root(chunk, tree.file_size, tree.leaves, tree.nchunks, digest);
+    free(tree.leaves);
+    return tree.failed ? -1 : 0;
+}
+
+/*
+ * str: size in bytes, optionally followed by K, M or G (powers of 1024)
+ * return: the size, 0 if str is not a valid size or does not fit in a size_t
+ */
+size_t parse_size(const char *str) {
+    char *end;
+    int shift = 0;
+    errno = 0;
+    unsigned long long size = strtoull(str, &end, 10);
+    if (end == str || errno == ERANGE) {
+        return 0;
+    }
+    switch (*end) {
+    case 'K': case 'k': shift = 10; ++end; break;
+    case 'M': case 'm': shift = 20; ++end; break;
+    case 'G': case 'g': shift = 30; ++end; break;
+    default: break;
+    }
+    if (*end != 0 || size > (UINT64_MAX >> shift) || (size << shift) > SIZE_MAX) {
+        return 0;
+    }
+    return (size_t)(size << shift);
+}
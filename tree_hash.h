@@ -0,0 +1,16 @@
+#ifndef TREE_HASH_H
+#define TREE_HASH_H
+#include <stddef.h>
+#include <stdint.h>
+#include "sm3.h"
+/*
+ * This header contains declearations of the chunked tree hash (SM3TREE),
+ * a digest different from plain SM3 that lets one file use all cores
+ */
+#define TREE_TAG "SM3TREE-"
+#define TREE_MAGIC "SM3TREE"
+
+int tree_hash_fd(int fd, size_t chunk, int threads, uint8_t *digest);
+size_t parse_size(const char *str);
+
+#endif // TREE_HASH_H
@@ -2,7 +2,21 @@
 #include <stdint.h>
 #include <stdlib.h>
 #include "sm3.h"
+#include "sm3_mb.h"
+#include "tree_hash.h"
+#include "read_pipeline.h"
+#include "digest_cache.h"
+#include "checkpoint.h"
+#include "walk.h"
+#include "dir_digest.h"
+#include "dupes.h"
+#include "serve.h"
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <pthread.h>
+#include <unistd.h>
 #include <stdio.h>
+#include <string.h>
 #include "file_handler.h"
     /*
  * This file contains tests for sm3 algorithm
@@ -10,32 +24,603 @@
 
 void sm3_padding_test() {
     // test case is from SM3 official document
-    uint8_t *buf = (uint8_t *)malloc(2048);
-    buf[0] = 0x61;
-    buf[1] = 0x62;
-    buf[2] = 0x63;
-    size_t bsize = 3 * 8;
-    sm3_padding(buf, &bsize, bsize);
-    sm3_iterate(buf, bsize);
-    free(buf);
+    uint8_t digest[SM3_DIGEST_SIZE];
+    uint8_t buf[3] = {0x61, 0x62, 0x63};
+    sm3(buf, sizeof(buf), digest);
+    sm3_print(digest, "abc");
 }
 
 void sm3_block_ext_test() {
     // test case from SM3 official document
-    uint8_t *buf = (uint8_t *)malloc(2048);
+    uint8_t digest[SM3_DIGEST_SIZE];
+    uint8_t *buf = (uint8_t *)malloc(64);
     for (int i = 0; i < 16; i++) {
         buf[i * 4 + 0] = 0x61;
         buf[i * 4 + 1] = 0x62;
         buf[i * 4 + 2] = 0x63;
         buf[i * 4 + 3] = 0x64;
     }
-    size_t bsize = 512;
-    sm3_padding(buf, &bsize, bsize);
-    sm3_iterate(buf, bsize);
+    sm3(buf, 64, digest);
+    sm3_print(digest, "abcd * 16");
     free(buf);
 }
 
-#include "file_handler.h"
+void sm3_stream_test() {
+    // feeding the same message in odd sized pieces must not change the result
+    uint8_t expected[SM3_DIGEST_SIZE], digest[SM3_DIGEST_SIZE];
+    uint8_t *buf = (uint8_t *)malloc(1000);
+    for (int i = 0; i < 1000; i++) {
+        buf[i] = (uint8_t)(i * 7 + 3);
+    }
+    sm3(buf, 1000, expected);
+    for (size_t step = 1; step <= 130; step++) {
+        sm3_ctx ctx;
+        sm3_init(&ctx);
+        for (size_t off = 0; off < 1000; off += step) {
+            sm3_update(&ctx, buf + off, off + step > 1000 ? 1000 - off : step);
+        }
+        sm3_final(&ctx, digest);
+        if (memcmp(expected, digest, SM3_DIGEST_SIZE) != 0) {
+            printf("Streaming mismatch with step %zu\n", step);
+        }
+    }
+    printf("Streaming test done\n");
+    free(buf);
+}
+
+void sm3_kernel_test() {
+    // every supported kernel must agree with the portable one, which is listed last
+    size_t count;
+    const sm3_kernel *kernels = sm3_kernel_list(&count);
+    uint32_t V_ref[8] = {IV0, IV1, IV2, IV3, IV4, IV5, IV6, IV7};
+    uint8_t *buf = (uint8_t *)malloc(5 * SM3_BLOCK_BYTES);
+    for (int i = 0; i < 5 * SM3_BLOCK_BYTES; i++) {
+        buf[i] = (uint8_t)(i * 29 + 5);
+    }
+    kernels[count - 1].iterate(V_ref, buf, 5);
+    for (size_t k = 0; k < count; k++) {
+        uint32_t V[8] = {IV0, IV1, IV2, IV3, IV4, IV5, IV6, IV7};
+        if (!kernels[k].supported()) {
+            printf("Kernel %s not supported, skipped\n", kernels[k].name);
+            continue;
+        }
+        kernels[k].iterate(V, buf, 5);
+        if (memcmp(V, V_ref, sizeof(V)) != 0) {
+            printf("Kernel %s mismatch\n", kernels[k].name);
+        }
+    }
+    printf("Kernel test done\n");
+    free(buf);
+}
+
+void sm3_mb_test() {
+    // every lane of the multi-buffer kernel must match the scalar kernel
+    uint32_t V_mb[SM3_MB_LANES][8], V_ref[SM3_MB_LANES][8];
+    uint32_t *V[SM3_MB_LANES];
+    const uint8_t *data[SM3_MB_LANES];
+    uint8_t *buf = (uint8_t *)malloc(SM3_MB_LANES * 3 * SM3_BLOCK_BYTES);
+    if (!sm3_mb_available()) {
+        printf("Multi-buffer kernel not available, skipped\n");
+        free(buf);
+        return;
+    }
+    for (int i = 0; i < SM3_MB_LANES * 3 * SM3_BLOCK_BYTES; i++) {
+        buf[i] = (uint8_t)(i * 131 + 17);
+    }
+    for (int l = 0; l < SM3_MB_LANES; l++) {
+        for (int i = 0; i < 8; i++) {
+            V_mb[l][i] = V_ref[l][i] = (uint32_t)(l * 8 + i) * 0x9e3779b9;
+        }
+        V[l] = V_mb[l];
+        data[l] = buf + l * 3 * SM3_BLOCK_BYTES;
+        sm3_iterate(V_ref[l], data[l], 3);
+    }
+    sm3_mb_iterate(V, data, 3);
+    if (memcmp(V_mb, V_ref, sizeof(V_mb)) != 0) {
+        printf("Multi-buffer mismatch\n");
+    }
+    printf("Multi-buffer test done\n");
+    free(buf);
+}
+
+void sm3_batch_test() {
+    // lengths around block and padding boundaries, more messages than lanes, any kernel
+    const char *kernels[] = {"avx2", "none"};
+    uint8_t buf[200], digests[40 * SM3_DIGEST_SIZE], expected[SM3_DIGEST_SIZE];
+    const void *data[40];
+    size_t len[40];
+    for (int i = 0; i < 200; i++) {
+        buf[i] = (uint8_t)(i * 7 + 3);
+    }
+    for (int i = 0; i < 40; i++) {
+        data[i] = buf + i;
+        len[i] = (i * 37) % 160;
+    }
+    for (int k = 0; k < 2; k++) {
+        if (sm3_mb_kernel_select(kernels[k]) != 0) {
+            continue;
+        }
+        sm3_batch(data, len, 40, digests);
+        for (int i = 0; i < 40; i++) {
+            sm3(data[i], len[i], expected);
+            if (memcmp(expected, digests + i * SM3_DIGEST_SIZE, SM3_DIGEST_SIZE) != 0) {
+                printf("Batch mismatch with %s kernel, message %d\n", kernels[k], i);
+            }
+        }
+    }
+    // back to the default choice
+    sm3_mb_kernel_select(kernels[0]);
+    printf("Batch test done\n");
+}
+
+void sm3_hmac_test() {
+    // HMAC-SM3 with a short and a hashed long key, the batch api, and the KDF of GM/T 0003
+    const uint8_t expected_short[SM3_DIGEST_SIZE] = {
+        0xbd, 0x4a, 0x34, 0x07, 0x78, 0x88, 0x16, 0x2b, 0x21, 0x06, 0x45, 0xb8, 0xeb, 0xf7, 0x4b, 0x9a,
+        0xf3, 0x57, 0x30, 0x37, 0x89, 0x35, 0x7a, 0x27, 0xc7, 0xfc, 0x45, 0x72, 0x44, 0xeb, 0xd3, 0x98};
+    const uint8_t expected_long[SM3_DIGEST_SIZE] = {
+        0xdd, 0xfd, 0x72, 0x7d, 0xf1, 0x1b, 0x43, 0x57, 0x60, 0xf1, 0xfa, 0x66, 0x38, 0xe2, 0xc0, 0x59,
+        0xa6, 0x6a, 0x74, 0xda, 0x84, 0x32, 0x81, 0x52, 0x01, 0x91, 0x52, 0x46, 0xe6, 0x21, 0x12, 0x94};
+    const uint8_t kdf_head[4] = {0xfe, 0x1e, 0xa8, 0x0d};
+    const uint8_t kdf_tail[6] = {0x29, 0x75, 0xa6, 0x60, 0xd3, 0x3e};
+    const char *fox = "The quick brown fox jumps over the lazy dog";
+    const char *large = "Test Using Larger Than Block-Size Key - Hash Key First";
+    uint8_t long_key[100], mac[SM3_DIGEST_SIZE], out[70];
+    sm3_hmac_key key;
+    sm3_hmac_ctx ctx;
+
+    sm3_hmac_key_init(&key, "key", 3);
+    sm3_hmac_init(&ctx, &key);
+    // split across calls, the streaming api must not care
+    sm3_hmac_update(&ctx, fox, 10);
+    sm3_hmac_update(&ctx, fox + 10, strlen(fox) - 10);
+    sm3_hmac_final(&ctx, mac);
+    if (memcmp(mac, expected_short, SM3_DIGEST_SIZE) != 0) {
+        printf("HMAC-SM3 with a short key is wrong\n");
+    }
+    memset(long_key, 0xaa, sizeof(long_key));
+    sm3_hmac_key_init(&key, long_key, sizeof(long_key));
+    sm3_hmac(&key, large, strlen(large), mac);
+    if (memcmp(mac, expected_long, SM3_DIGEST_SIZE) != 0) {
+        printf("HMAC-SM3 with a long key is wrong\n");
+    }
+
+    uint8_t buf[200], macs[40 * SM3_DIGEST_SIZE];
+    const void *data[40];
+    size_t len[40];
+    for (int i = 0; i < 200; i++) {
+        buf[i] = (uint8_t)(i * 11 + 1);
+    }
+    for (int i = 0; i < 40; i++) {
+        data[i] = buf + i;
+        len[i] = (i * 29) % 150;
+    }
+    sm3_hmac_batch(&key, data, len, 40, macs);
+    for (int i = 0; i < 40; i++) {
+        sm3_hmac(&key, data[i], len[i], mac);
+        if (memcmp(mac, macs + i * SM3_DIGEST_SIZE, SM3_DIGEST_SIZE) != 0) {
+            printf("HMAC-SM3 batch mismatch, message %d\n", i);
+        }
+    }
+
+    sm3_kdf("abc", 3, out, sizeof(out));
+    if (memcmp(out, kdf_head, sizeof(kdf_head)) != 0 || memcmp(out + 64, kdf_tail, sizeof(kdf_tail)) != 0) {
+        printf("SM3 KDF is wrong\n");
+    }
+    printf("HMAC test done\n");
+}
+
+void sm3_tree_test() {
+    // a file of 2.5 chunks hashed by 3 threads must match the construction done by hand
+    size_t chunk = 4096, size = 10240;
+    uint8_t digest[SM3_DIGEST_SIZE], expected[SM3_DIGEST_SIZE];
+    uint8_t header[24], leaves[3 * SM3_DIGEST_SIZE];
+    uint8_t *buf = (uint8_t *)malloc(size);
+    char path[] = "/tmp/sm3_tree_testXXXXXX";
+    int fd = mkstemp(path);
+    for (size_t i = 0; i < size; i++) {
+        buf[i] = (uint8_t)(i * 13 + 1);
+    }
+    if (fd < 0 || write(fd, buf, size) != (ssize_t)size) {
+        printf("Cannot create temporary file, skipped\n");
+        free(buf);
+        return;
+    }
+    for (int i = 0; i < 3; i++) {
+        sm3(buf + i * chunk, i < 2 ? chunk : size - 2 * chunk, leaves + i * SM3_DIGEST_SIZE);
+    }
+    uint64_t chunk_be = local_to_be(chunk), size_be = local_to_be(size);
+    memcpy(header, TREE_MAGIC, 8);
+    memcpy(header + 8, &chunk_be, 8);
+    memcpy(header + 16, &size_be, 8);
+    sm3_ctx ctx;
+    sm3_init(&ctx);
+    sm3_update(&ctx, header, sizeof(header));
+    sm3_update(&ctx, leaves, sizeof(leaves));
+    sm3_final(&ctx, expected);
+    if (tree_hash_fd(fd, chunk, 3, digest) != 0 || memcmp(digest, expected, SM3_DIGEST_SIZE) != 0) {
+        printf("Tree hash mismatch\n");
+    }
+    // chunk sizes, a suffix must not wrap around
+    if (parse_size("64") != 64 || parse_size("4k") != 4096 || parse_size("2G") != (size_t)2 << 30 ||
+        parse_size("99999999999G") != 0 || parse_size("1T") != 0 || parse_size("") != 0) {
+        printf("Size parsing is wrong\n");
+    }
+    printf("Tree hash test done\n");
+    close(fd);
+    unlink(path);
+    free(buf);
+}
+
+void sm3_pipeline_test() {
+    // a file spanning several pipeline buffers, read by every --io mode, with and without --direct
+    size_t size = PIPELINE_BUF_SIZE * 2 + 12345;
+    uint8_t digest[SM3_DIGEST_SIZE], expected[SM3_DIGEST_SIZE];
+    uint8_t *buf = (uint8_t *)malloc(size);
+    char path[] = "/tmp/sm3_pipeline_testXXXXXX";
+    int fd = mkstemp(path);
+    for (size_t i = 0; i < size; i++) {
+        buf[i] = (uint8_t)(i * 11 + 7);
+    }
+    if (fd < 0 || write(fd, buf, size) != (ssize_t)size) {
+        printf("Cannot create temporary file, skipped\n");
+        free(buf);
+        return;
+    }
+    close(fd);
+    sm3(buf, size, expected);
+    sm3_io_mode saved = sm3_args.io_mode;
+    sm3_io_mode modes[] = {IO_MMAP, IO_URING, IO_THREAD};
+    // the odd size leaves an unaligned tail for --direct
+    for (int m = 0; m < 6; m++) {
+        FILE *fp = fopen(path, "r");
+        sm3_args.io_mode = modes[m % 3];
+        sm3_args.direct = m >= 3;
+        if (read_and_calc(fp, digest, NULL) != 0 || memcmp(digest, expected, SM3_DIGEST_SIZE) != 0) {
+            printf("Read mode %d mismatch\n", m);
+        }
+        fclose(fp);
+    }
+    sm3_args.io_mode = saved;
+    sm3_args.direct = false;
+    printf("Pipeline test done\n");
+    unlink(path);
+    free(buf);
+}
+
+void sm3_sparse_test() {
+    // holes at the start, in the middle and at the end, data at unaligned offsets in between
+    size_t size = (6 << 20) + 777;
+    off_t data_at[2] = {(3 << 20) + 100, (5 << 20) - 10};
+    uint8_t digest[SM3_DIGEST_SIZE], expected[SM3_DIGEST_SIZE];
+    uint8_t *buf = (uint8_t *)calloc(size, 1);
+    char path[] = "/tmp/sm3_sparse_testXXXXXX";
+    int fd = mkstemp(path);
+    bool ok = fd >= 0 && ftruncate(fd, size) == 0;
+    for (int d = 0; d < 2 && ok; d++) {
+        for (size_t i = 0; i < 5000; i++) {
+            buf[data_at[d] + i] = (uint8_t)(i * 13 + d);
+        }
+        ok = pwrite(fd, buf + data_at[d], 5000, data_at[d]) == 5000;
+    }
+    if (!ok) {
+        printf("Cannot create temporary file, skipped\n");
+        free(buf);
+        return;
+    }
+    close(fd);
+    sm3(buf, size, expected);
+    FILE *fp = fopen(path, "r");
+    if (read_and_calc(fp, digest, NULL) != 0 || memcmp(digest, expected, SM3_DIGEST_SIZE) != 0) {
+        printf("Sparse file mismatch\n");
+    }
+    fclose(fp);
+    printf("Sparse test done\n");
+    unlink(path);
+    free(buf);
+}
+
+void sm3_cache_test() {
+    // a made-up file status, old enough to be cached
+    char path[] = "/tmp/sm3_cache_testXXXXXX";
+    int fd = mkstemp(path);
+    uint8_t digest[SM3_DIGEST_SIZE], found[SM3_DIGEST_SIZE];
+    struct stat st;
+    if (fd < 0) {
+        printf("Cannot create temporary file, skipped\n");
+        return;
+    }
+    close(fd);
+    memset(&st, 0, sizeof(st));
+    st.st_dev = 1;
+    st.st_ino = 42;
+    st.st_size = 3;
+    st.st_mtim.tv_sec = st.st_ctim.tv_sec = 1000000000;
+    sm3((const uint8_t *)"abc", 3, digest);
+
+    digest_cache *cache = cache_open(path);
+    cache_store(cache, &st, &st, 0, digest);
+    cache_close(cache);
+    cache = cache_open(path);
+    if (!cache_lookup(cache, &st, 0, found) || memcmp(found, digest, SM3_DIGEST_SIZE) != 0) {
+        printf("Stored digest not found\n");
+    }
+    if (cache_lookup(cache, &st, 1024, found)) {
+        printf("Tree digest mistaken for plain SM3\n");
+    }
+    st.st_ctim.tv_nsec = 1;
+    if (cache_lookup(cache, &st, 0, found)) {
+        printf("Changed file still cached\n");
+    }
+    cache_close(cache);
+    printf("Cache test done\n");
+    unlink(path);
+}
+
+void sm3_checkpoint_test() {
+    // a file hashed to its end leaves no checkpoint, an extended file hashes from the start
+    char path[] = "/tmp/sm3_checkpoint_testXXXXXX";
+    char sidecar[sizeof(path) + sizeof(CHECKPOINT_SUFFIX)];
+    uint8_t buf[3000], digest[SM3_DIGEST_SIZE], expected[SM3_DIGEST_SIZE];
+    int fd = mkstemp(path);
+    for (size_t i = 0; i < sizeof(buf); i++) {
+        buf[i] = (uint8_t)(i * 7 + 1);
+    }
+    if (fd < 0 || write(fd, buf, 1000) != 1000) {
+        printf("Cannot create temporary file, skipped\n");
+        return;
+    }
+    snprintf(sidecar, sizeof(sidecar), "%s" CHECKPOINT_SUFFIX, path);
+    sm3(buf, 1000, expected);
+    if (checkpoint_hash(path, fd, 64, digest, NULL) != 0 || memcmp(digest, expected, SM3_DIGEST_SIZE) != 0) {
+        printf("First pass mismatch\n");
+    }
+    if (access(sidecar, F_OK) == 0) {
+        printf("Checkpoint left behind\n");
+    }
+    if (pwrite(fd, buf + 1000, 2000, 1000) != 2000) {
+        printf("Cannot extend temporary file, skipped\n");
+    }
+    sm3(buf, sizeof(buf), expected);
+    if (checkpoint_hash(path, fd, 64, digest, NULL) != 0 || memcmp(digest, expected, SM3_DIGEST_SIZE) != 0) {
+        printf("Extended pass mismatch\n");
+    }
+    close(fd);
+    printf("Checkpoint test done\n");
+    unlink(sidecar);
+    unlink(path);
+}
+
+void sm3_walk_test() {
+    // a small tree, listed by several threads, must come out in the same sorted order
+    char root[] = "/tmp/sm3_walk_testXXXXXX";
+    const char *dirs[] = {"a", "a/b", "a.d"};
+    const char *files[] = {"a/1", "a/b/2", "a.d/3", "x"};
+    char path[64];
+    if (mkdtemp(root) == NULL) {
+        printf("Cannot create temporary directory, skipped\n");
+        return;
+    }
+    for (int i = 0; i < 3; i++) {
+        snprintf(path, sizeof(path), "%s/%s", root, dirs[i]);
+        mkdir(path, 0700);
+    }
+    for (int i = 0; i < 4; i++) {
+        snprintf(path, sizeof(path), "%s/%s", root, files[i]);
+        fclose(fopen(path, "w"));
+    }
+    walk_options options = {false, false, false, NULL};
+    char *roots[] = {root};
+    size_t count;
+    char **found = walk_paths(roots, 1, 4, &options, &count, NULL);
+    if (count != 4) {
+        printf("Found %zu files instead of 4\n", count);
+    }
+    for (size_t i = 0; i < count && i < 4; i++) {
+        snprintf(path, sizeof(path), "%s/%s", root, files[i]);
+        if (strcmp(found[i], path) != 0) {
+            printf("Expected %s, found %s\n", path, found[i]);
+        }
+    }
+    free(found);
+    for (int i = 3; i >= 0; i--) {
+        snprintf(path, sizeof(path), "%s/%s", root, files[i]);
+        unlink(path);
+    }
+    for (int i = 2; i >= 0; i--) {
+        snprintf(path, sizeof(path), "%s/%s", root, dirs[i]);
+        rmdir(path);
+    }
+    rmdir(root);
+    printf("Walk test done\n");
+}
+
+void sm3_dir_digest_test() {
+    // SM3DIR of a known tree, the same for any number of threads, and a changed file changes it
+    char root[] = "/tmp/sm3_dir_digest_testXXXXXX";
+    char path[64], link[64];
+    uint8_t digest[SM3_DIGEST_SIZE], again[SM3_DIGEST_SIZE];
+    const uint8_t expected[SM3_DIGEST_SIZE] = {
+        0xe3, 0xf2, 0xc4, 0xe4, 0xaa, 0x92, 0x05, 0xef, 0x9b, 0xf3, 0x67, 0x1e, 0xae, 0xff, 0x90, 0x11,
+        0x52, 0xfc, 0xaf, 0xf0, 0xb1, 0xfa, 0x0a, 0x5d, 0x61, 0x21, 0x10, 0xe4, 0xfc, 0x64, 0xdc, 0xe3};
+    if (mkdtemp(root) == NULL) {
+        printf("Cannot create temporary directory, skipped\n");
+        return;
+    }
+    snprintf(path, sizeof(path), "%s/a", root);
+    mkdir(path, 0700);
+    snprintf(path, sizeof(path), "%s/x", root);
+    fclose(fopen(path, "w"));
+    snprintf(link, sizeof(link), "%s/l", root);
+    if (symlink("a/1", link) != 0) {
+        printf("Cannot create symbolic link\n");
+    }
+    snprintf(path, sizeof(path), "%s/a/1", root);
+    FILE *fp = fopen(path, "w");
+    fputs("abc", fp);
+    fclose(fp);
+
+    if (dir_digest(root, 1, NULL, NULL, digest) != 0 || memcmp(digest, expected, SM3_DIGEST_SIZE) != 0) {
+        printf("SM3DIR of the test tree is wrong\n");
+    }
+    if (dir_digest(root, 4, NULL, NULL, again) != 0 || memcmp(digest, again, SM3_DIGEST_SIZE) != 0) {
+        printf("SM3DIR depends on the number of threads\n");
+    }
+    fp = fopen(path, "w");
+    fputs("abd", fp);
+    fclose(fp);
+    if (dir_digest(root, 4, NULL, NULL, again) != 0 || memcmp(digest, again, SM3_DIGEST_SIZE) == 0) {
+        printf("SM3DIR did not change with a file\n");
+    }
+
+    unlink(path);
+    unlink(link);
+    snprintf(path, sizeof(path), "%s/x", root);
+    unlink(path);
+    snprintf(path, sizeof(path), "%s/a", root);
+    rmdir(path);
+    rmdir(root);
+    printf("Directory digest test done\n");
+}
+
+void sm3_dupes_test() {
+    // copies longer than the prefix, a file differing in its last byte, a hard link and short copies
+    char root[] = "/tmp/sm3_dupes_testXXXXXX";
+    char paths[6][64], out_path[] = "/tmp/sm3_dupes_outXXXXXX";
+    char *names[6];
+    const char *leaves[6] = {"p1", "p2", "p3", "h", "s1", "s2"};
+    uint8_t *buf = (uint8_t *)malloc(8000);
+    uint8_t long_digest[SM3_DIGEST_SIZE], short_digest[SM3_DIGEST_SIZE];
+    char expected[1024], got[1024] = {0}, hex[2 * SM3_DIGEST_SIZE + 1] = {0};
+    if (mkdtemp(root) == NULL) {
+        printf("Cannot create temporary directory, skipped\n");
+        free(buf);
+        return;
+    }
+    for (int i = 0; i < 8000; i++) {
+        buf[i] = (uint8_t)(i * 5 + 1);
+    }
+    for (int i = 0; i < 6; i++) {
+        snprintf(paths[i], sizeof(paths[i]), "%s/%s", root, leaves[i]);
+        names[i] = paths[i];
+    }
+    for (int i = 0; i < 3; i++) {
+        // p3 only differs in its last byte
+        buf[7999] ^= i == 2;
+        FILE *fp = fopen(paths[i], "w");
+        fwrite(buf, 1, 8000, fp);
+        fclose(fp);
+        buf[7999] ^= i == 2;
+    }
+    if (link(paths[0], paths[3]) != 0) {
+        printf("Cannot create hard link\n");
+    }
+    for (int i = 4; i < 6; i++) {
+        FILE *fp = fopen(paths[i], "w");
+        fputs("abc", fp);
+        fclose(fp);
+    }
+    sm3(buf, 8000, long_digest);
+    sm3("abc", 3, short_digest);
+    int pos = 0;
+    sm3_hex(long_digest, hex);
+    pos += snprintf(expected + pos, sizeof(expected) - pos, "%s  %s\n%s  %s\n\n", hex, names[0], hex, names[1]);
+    sm3_hex(short_digest, hex);
+    snprintf(expected + pos, sizeof(expected) - pos, "%s  %s\n%s  %s\n", hex, names[4], hex, names[5]);
+
+    // catch what find_duplicates() prints
+    int out = mkstemp(out_path);
+    int saved = dup(STDOUT_FILENO);
+    fflush(stdout);
+    dup2(out, STDOUT_FILENO);
+    find_duplicates(names, 6, 2);
+    fflush(stdout);
+    dup2(saved, STDOUT_FILENO);
+    close(saved);
+    if (pread(out, got, sizeof(got) - 1, 0) < 0 || strcmp(got, expected) != 0) {
+        printf("Duplicate groups are wrong:\n%s", got);
+    }
+    close(out);
+    unlink(out_path);
+    for (int i = 0; i < 6; i++) {
+        unlink(paths[i]);
+    }
+    rmdir(root);
+    free(buf);
+    printf("Duplicates test done\n");
+}
+
+static void *serve_test_run(void *arg) {
+    serve_connection((int)(intptr_t)arg);
+    return NULL;
+}
+
+void sm3_serve_test() {
+    // inline data, a file, a missing file and a relative path in one batch, over a socket pair
+    // instead of a listening socket
+    int fds[2];
+    pthread_t server;
+    char path[] = "/tmp/sm3_serve_testXXXXXX";
+    const char *missing = "/nonexistent/sm3_serve_test";
+    const char *relative = "unit_test.c";
+    uint8_t digests[4 * SM3_DIGEST_SIZE], expected[SM3_DIGEST_SIZE];
+    bool failed[4];
+    int fd = mkstemp(path);
+    if (fd < 0 || write(fd, "abc", 3) != 3 || socketpair(AF_UNIX, SOCK_STREAM, 0, fds) != 0) {
+        printf("Cannot create temporary file, skipped\n");
+        return;
+    }
+    close(fd);
+    pthread_create(&server, NULL, serve_test_run, (void *)(intptr_t)fds[1]);
+    serve_request requests[4] = {{SERVE_DATA, "abc", 3}, {SERVE_PATH, path, strlen(path)},
+                                 {SERVE_PATH, missing, strlen(missing)}, {SERVE_PATH, relative, strlen(relative)}};
+    sm3("abc", 3, expected);
+    // twice, a connection carries any number of batches
+    for (int round = 0; round < 2; round++) {
+        if (serve_call(fds[0], requests, 4, digests, failed) != 0) {
+            printf("Server did not answer\n");
+            break;
+        }
+        if (failed[0] || failed[1] || !failed[2] || !failed[3] || memcmp(digests, expected, SM3_DIGEST_SIZE) != 0 ||
+            memcmp(digests + SM3_DIGEST_SIZE, expected, SM3_DIGEST_SIZE) != 0) {
+            printf("Server answers are wrong\n");
+        }
+    }
+    close(fds[0]);
+    pthread_join(server, NULL);
+    unlink(path);
+
+    // replies carry plain SM3, a key on either side must be refused
+    sm3_hmac_key key;
+    sm3_hmac_key_init(&key, "key", 3);
+    sm3_args.hmac_key = &key;
+    if (serve_conflict() == NULL || strcmp(serve_conflict(), "--hmac-key-file") != 0) {
+        printf("--hmac-key-file is not refused with --serve and --client\n");
+    }
+    sm3_args.hmac_key = NULL;
+    printf("Serve test done\n");
+}
+
+void sm3_hex_test() {
+    // every byte must give two digits, leading zeros included, and -c must read the line back
+    extern file_sm3_pair hash_pair_head;
+    uint8_t digest[SM3_DIGEST_SIZE];
+    char line[2 * SM3_DIGEST_SIZE + 16] = {0};
+    for (int i = 0; i < SM3_DIGEST_SIZE; i++) {
+        digest[i] = (uint8_t)(i * 0x11 >> 1);
+    }
+    sm3_hex(digest, line);
+    if (strcmp(line, "00081119222a333b444c555d666e777f889099a1aab2bbc3ccd4dde5eef6ff07") != 0) {
+        printf("Hex mismatch: %s\n", line);
+    }
+    memcpy(line + 2 * SM3_DIGEST_SIZE, "  a.out", 8);
+    parse_checklist_init();
+    if (parse_checklist(line, strlen(line)) != 0 ||
+        memcmp(hash_pair_head.next->expected_sm3, digest, SM3_DIGEST_SIZE) != 0) {
+        printf("Hex line not read back\n");
+    }
+    printf("Hex test done\n");
+}
 
 void sm3_parse_checklist_test() {
     // test that checklist works properly
@@ -51,9 +636,6 @@ void sm3_parse_checklist_test() {
         printf("%x", hash_pair_head.next->expected_sm3[i]);
     }
     printf("\n");
-    if (hash_pair_head.next->file_name != NULL) {
-        free(hash_pair_head.next->file_name);
-    }
     char buf_bsd_2[] = "SM3(a.out) = 66c7f0f462eeedd9d1f2d46bdc10e4e24167c4875cf2f7a2297da02b8f4ba8e0";
     size_bsd = strlen(buf_bsd_2);
     parse_checklist_init();
@@ -63,9 +645,6 @@ void sm3_parse_checklist_test() {
         printf("%x", hash_pair_head.next->expected_sm3[i]);
     }
     printf("\n");
-    if (hash_pair_head.next->file_name != NULL) {
-        free(hash_pair_head.next->file_name);
-    }
 
     // non-BSD style
      sm3_args.bsd_tag = false;
@@ -78,9 +657,32 @@ void sm3_parse_checklist_test() {
         printf("%x", hash_pair_head.next->expected_sm3[i]);
     }
     printf("\n");
-    if (hash_pair_head.next->file_name != NULL) {
-        free(hash_pair_head.next->file_name);
+
+    // names with spaces, parentheses and escapes, the format is told by the line itself
+    char *lines[] = {
+        "66C7F0F462EEEDD9D1F2D46BDC10E4E24167C4875CF2F7A2297DA02B8F4BA8E0  a b",
+        "66c7f0f462eeedd9d1f2d46bdc10e4e24167c4875cf2f7a2297da02b8f4ba8e0 *a b",
+        "\\66c7f0f462eeedd9d1f2d46bdc10e4e24167c4875cf2f7a2297da02b8f4ba8e0  a\\nb\\\\c",
+        "SM3 (x (1).txt) = 66c7f0f462eeedd9d1f2d46bdc10e4e24167c4875cf2f7a2297da02b8f4ba8e0\r",
+        "SM3(x (1).txt)= 66c7f0f462eeedd9d1f2d46bdc10e4e24167c4875cf2f7a2297da02b8f4ba8e0",
+    };
+    const char *names[] = {"a b", "a b", "a\nb\\c", "x (1).txt", "x (1).txt"};
+    const uint8_t expected[4] = {0x66, 0xc7, 0xf0, 0xf4};
+    for (int i = 0; i < 5; i++) {
+        char line[160];
+        strcpy(line, lines[i]);
+        parse_checklist_init();
+        if (parse_checklist(line, strlen(line)) != 0 || strcmp(hash_pair_head.next->file_name, names[i]) != 0 ||
+            memcmp(hash_pair_head.next->expected_sm3, expected, sizeof(expected)) != 0) {
+            printf("Line %d parsed wrong\n", i);
+        }
+    }
+    char bad_hex[] = "66c7f0f462eeedd9d1f2d46bdc10e4e24167c4875cf2f7a2297da02b8f4ba8eg  a";
+    char short_hash[] = "66c7f0f462eeedd9d1f2d46bdc10e4e24167c4875cf2f7a2297da02b8f4ba8e a";
+    if (parse_checklist(bad_hex, strlen(bad_hex)) == 0 || parse_checklist(short_hash, strlen(short_hash)) == 0) {
+        printf("Improper line accepted\n");
     }
+    printf("Checklist formats done\n");
 }
 
 void sm3_parse_filelist_test() {
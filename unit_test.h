@@ -3,6 +3,21 @@
 
 void sm3_padding_test();
 void sm3_block_ext_test();
+void sm3_stream_test();
+void sm3_kernel_test();
+void sm3_mb_test();
+void sm3_batch_test();
+void sm3_hmac_test();
+void sm3_tree_test();
+void sm3_pipeline_test();
+void sm3_sparse_test();
+void sm3_cache_test();
+void sm3_checkpoint_test();
+void sm3_walk_test();
+void sm3_dir_digest_test();
+void sm3_dupes_test();
+void sm3_serve_test();
+void sm3_hex_test();
 void sm3_parse_checklist_test();
 void sm3_parse_filelist_test();
 #endif // UNIT_TEST_H
\ No newline at end of file
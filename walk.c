@@ -0,0 +1,409 @@
+#include "walk.h"
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+/*
+ * Directories waiting to be read form a stack shared by the workers. A worker pops one,
+ * opens it with openat() relative to its parent, and pushes the subdirectories it finds,
+ * so no lookup walks the whole path again. The stack makes the walk roughly depth first:
+ * only the directories on the way down to the ones being read keep a descriptor open.
+ * Files are collected per worker and sorted once everything is listed.
+ */
+
+#define ARENA_BLOCK (1 << 20) // strings are carved out of blocks of this size
+
+typedef struct dir_handle {
+    int fd;
+    dev_t dev;
+    ino_t ino;
+    struct dir_handle *parent; // kept alive by its children, for loop detection
+    size_t refs; // waiting or open subdirectories, plus one while the directory itself is read
+} dir_handle;
+
+typedef struct {
+    dir_handle *parent; // NULL for a starting path
+    const char *name; // relative to parent
+    const char *path; // as printed
+    dev_t dev; // file system of the starting path
+    size_t root; // index of the starting path
+} dir_task;
+
+typedef struct {
+    const char *path;
+    size_t root;
+    char type; // WALK_FILE, WALK_DIR or WALK_LINK
+} walk_file;
+
+/*
+ * what one worker collects, no other thread touches it until the walk is over
+ */
+typedef struct {
+    walk_file *files;
+    size_t count, cap;
+    char *block; // current string block, strings live until exit
+    size_t left;
+    pthread_t thread;
+    struct walker *walker;
+} walk_list;
+
+typedef struct walker {
+    const walk_options *options;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    dir_task *tasks;
+    size_t ntasks, cap;
+    int busy; // workers reading a directory, they may still push more
+} walker;
+
+static void out_of_memory() {
+    fprintf(stderr, "sm3sum: out of memory\n");
+    exit(1);
+}
+
+/*
+ * return: len bytes from the list's arena
+ */
+static char *list_alloc(walk_list *list, size_t len) {
+    if (len > list->left) {
+        size_t size = len > ARENA_BLOCK ? len : ARENA_BLOCK;
+        list->block = (char *)malloc(size);
+        if (list->block == NULL) {
+            out_of_memory();
+        }
+        list->left = size;
+    }
+    char *mem = list->block;
+    list->block += len;
+    list->left -= len;
+    return mem;
+}
+
+/*
+ * return: dir/name, without doubling a trailing slash of dir
+ */
+static char *join_path(walk_list *list, const char *dir, const char *name) {
+    size_t dir_len = strlen(dir), name_len = strlen(name);
+    bool slash = dir_len > 0 && dir[dir_len - 1] != '/';
+    char *path = list_alloc(list, dir_len + slash + name_len + 1);
+    memcpy(path, dir, dir_len);
+    if (slash) {
+        path[dir_len] = '/';
+    }
+    memcpy(path + dir_len + slash, name, name_len + 1);
+    return path;
+}
+
+/*
+ * return: whether name ends in suffix
+ */
+static bool has_suffix(const char *name, const char *suffix) {
+    size_t name_len = strlen(name), suffix_len = strlen(suffix);
+    return name_len >= suffix_len && memcmp(name + name_len - suffix_len, suffix, suffix_len) == 0;
+}
+
+static void list_add(walk_list *list, const char *path, size_t root, char type) {
+    if (list->count == list->cap) {
+        list->cap = list->cap ? list->cap * 2 : 1024;
+        list->files = (walk_file *)realloc(list->files, list->cap * sizeof(walk_file));
+        if (list->files == NULL) {
+            out_of_memory();
+        }
+    }
+    list->files[list->count].path = path;
+    list->files[list->count].type = type;
+    list->files[list->count++].root = root;
+}
+
+/*
+ * function: drop one reference to a directory, called with the walker locked
+ */
+static void dir_release(dir_handle *dir) {
+    while (dir != NULL && --dir->refs == 0) {
+        dir_handle *parent = dir->parent;
+        close(dir->fd);
+        free(dir);
+        dir = parent;
+    }
+}
+
+/*
+ * function: list one directory, files go to list, subdirectories to the stack
+ */
+static void walk_dir(walker *w, walk_list *list, const dir_task *task) {
+    const walk_options *options = w->options;
+    int flags = O_RDONLY | O_DIRECTORY | O_CLOEXEC;
+    if (task->parent != NULL && !options->follow_symlinks) {
+        // the entry was a directory when listed, do not let a symlink swapped in take us elsewhere
+        flags |= O_NOFOLLOW;
+    }
+    int fd = openat(task->parent != NULL ? task->parent->fd : AT_FDCWD, task->name, flags);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0) {
+        fprintf(stderr, "sm3sum: cannot read directory %s: %s\n", task->path, strerror(errno));
+        if (fd >= 0) {
+            close(fd);
+        }
+        return;
+    }
+    if (options->one_file_system && st.st_dev != task->dev) {
+        close(fd);
+        return;
+    }
+    for (dir_handle *up = task->parent; up != NULL; up = up->parent) {
+        // a symbolic link back up the tree, ancestors do not change while we hold a reference
+        if (up->dev == st.st_dev && up->ino == st.st_ino) {
+            fprintf(stderr, "sm3sum: %s: file system loop detected\n", task->path);
+            close(fd);
+            return;
+        }
+    }
+    int list_fd = dup(fd);
+    DIR *dir = list_fd >= 0 ? fdopendir(list_fd) : NULL;
+    if (dir == NULL) {
+        fprintf(stderr, "sm3sum: cannot read directory %s: %s\n", task->path, strerror(errno));
+        if (list_fd >= 0) {
+            close(list_fd);
+        }
+        close(fd);
+        return;
+    }
+    dir_handle *handle = (dir_handle *)malloc(sizeof(dir_handle));
+    if (handle == NULL) {
+        out_of_memory();
+    }
+    handle->fd = fd;
+    handle->dev = st.st_dev;
+    handle->ino = st.st_ino;
+    handle->parent = task->parent;
+    handle->refs = 1;
+    if (task->parent != NULL) {
+        pthread_mutex_lock(&w->lock);
+        ++task->parent->refs;
+        pthread_mutex_unlock(&w->lock);
+    }
+
+    dir_task *subdirs = NULL;
+    size_t nsubdirs = 0, subdirs_cap = 0;
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL) {
+        const char *name = entry->d_name;
+        if (name[0] == '.' && (name[1] == 0 || (name[1] == '.' && name[2] == 0))) {
+            continue;
+        }
+        unsigned char type = entry->d_type;
+        if (type == DT_UNKNOWN || (type == DT_LNK && options->follow_symlinks)) {
+            struct stat entry_st;
+            if (fstatat(fd, name, &entry_st, options->follow_symlinks ? 0 : AT_SYMLINK_NOFOLLOW) == 0) {
+                type = S_ISREG(entry_st.st_mode) ? DT_REG : S_ISDIR(entry_st.st_mode) ? DT_DIR :
+                       S_ISLNK(entry_st.st_mode) ? DT_LNK : DT_UNKNOWN;
+            } else if (type != DT_LNK) {
+                // vanished meanwhile
+                continue;
+            }
+            // a dangling link stays a link
+        }
+        if (type == DT_REG) {
+            if (options->skip_suffix != NULL && has_suffix(name, options->skip_suffix)) {
+                continue;
+            }
+            list_add(list, join_path(list, task->path, name), task->root, WALK_FILE);
+        } else if (type == DT_LNK && options->all_entries) {
+            list_add(list, join_path(list, task->path, name), task->root, WALK_LINK);
+        } else if (type == DT_DIR) {
+            if (nsubdirs == subdirs_cap) {
+                subdirs_cap = subdirs_cap ? subdirs_cap * 2 : 16;
+                subdirs = (dir_task *)realloc(subdirs, subdirs_cap * sizeof(dir_task));
+                if (subdirs == NULL) {
+                    out_of_memory();
+                }
+            }
+            char *path = join_path(list, task->path, name);
+            if (options->all_entries) {
+                list_add(list, path, task->root, WALK_DIR);
+            }
+            subdirs[nsubdirs].parent = handle;
+            subdirs[nsubdirs].path = path;
+            subdirs[nsubdirs].name = path + strlen(path) - strlen(name);
+            subdirs[nsubdirs].dev = task->dev;
+            subdirs[nsubdirs].root = task->root;
+            ++nsubdirs;
+        }
+        // devices, fifos and sockets are left out, so are symbolic links unless asked for
+    }
+    closedir(dir);
+
+    pthread_mutex_lock(&w->lock);
+    if (w->ntasks + nsubdirs > w->cap) {
+        w->cap = (w->ntasks + nsubdirs) * 2;
+        w->tasks = (dir_task *)realloc(w->tasks, w->cap * sizeof(dir_task));
+        if (w->tasks == NULL) {
+            out_of_memory();
+        }
+    }
+    if (nsubdirs > 0) {
+        memcpy(w->tasks + w->ntasks, subdirs, nsubdirs * sizeof(dir_task));
+    }
+    w->ntasks += nsubdirs;
+    handle->refs += nsubdirs;
+    dir_release(handle);
+    if (nsubdirs > 0) {
+        pthread_cond_broadcast(&w->cond);
+    }
+    pthread_mutex_unlock(&w->lock);
+    free(subdirs);
+}
+
+static void *walk_worker(void *arg) {
+    walk_list *list = (walk_list *)arg;
+    walker *w = list->walker;
+    pthread_mutex_lock(&w->lock);
+    while (true) {
+        while (w->ntasks == 0 && w->busy > 0) {
+            pthread_cond_wait(&w->cond, &w->lock);
+        }
+        if (w->ntasks == 0) {
+            // nobody is reading a directory, so nothing more can come
+            break;
+        }
+        dir_task task = w->tasks[--w->ntasks];
+        ++w->busy;
+        pthread_mutex_unlock(&w->lock);
+        walk_dir(w, list, &task);
+        pthread_mutex_lock(&w->lock);
+        dir_release(task.parent);
+        --w->busy;
+    }
+    pthread_cond_broadcast(&w->cond);
+    pthread_mutex_unlock(&w->lock);
+    return NULL;
+}
+
+/*
+ * function: order paths the way a depth first walk over sorted names would,
+ * '/' comes before every other byte so that a directory is followed by its content
+ */
+static int path_cmp(const void *a, const void *b) {
+    const walk_file *x = (const walk_file *)a, *y = (const walk_file *)b;
+    if (x->root != y->root) {
+        return x->root < y->root ? -1 : 1;
+    }
+    const unsigned char *p = (const unsigned char *)x->path, *q = (const unsigned char *)y->path;
+    while (*p != 0 && *p == *q) {
+        ++p;
+        ++q;
+    }
+    int c = *p == '/' ? 1 : *p, d = *q == '/' ? 1 : *q;
+    return c - d;
+}
+
+/*
+ * roots: the paths given, directories are walked, anything else is taken as it is
+ * nroots: number of roots
+ * threads: number of threads listing directories
+ * options: how to treat symbolic links and mount points met during the walk,
+ * symbolic links given as roots are always followed
+ * count: receives the number of files
+ * types: if not NULL, receives the WALK_* kind of every entry, to be freed by the caller
+ * return: the regular files found (and other entries with all_entries), grouped by root in
+ * the order of roots and sorted within a root; the array and the names stay allocated until exit
+ */
+char **walk_paths(char *const *roots, size_t nroots, int threads, const walk_options *options,
+                  size_t *count, char **types) {
+    walker w;
+    memset(&w, 0, sizeof(w));
+    w.options = options;
+    pthread_mutex_init(&w.lock, NULL);
+    pthread_cond_init(&w.cond, NULL);
+    if (threads < 1) {
+        threads = 1;
+    }
+    walk_list *lists = (walk_list *)calloc(threads, sizeof(walk_list));
+    if (lists == NULL) {
+        out_of_memory();
+    }
+
+    for (size_t i = 0; i < nroots; i++) {
+        struct stat st;
+        if (stat(roots[i], &st) != 0 || !S_ISDIR(st.st_mode)) {
+            // hashed as given, a missing one is reported there
+            list_add(&lists[0], roots[i], i, WALK_FILE);
+            continue;
+        }
+        if (w.ntasks == w.cap) {
+            w.cap = w.cap ? w.cap * 2 : 16;
+            w.tasks = (dir_task *)realloc(w.tasks, w.cap * sizeof(dir_task));
+            if (w.tasks == NULL) {
+                out_of_memory();
+            }
+        }
+        w.tasks[w.ntasks].parent = NULL;
+        w.tasks[w.ntasks].name = roots[i];
+        w.tasks[w.ntasks].path = roots[i];
+        w.tasks[w.ntasks].dev = st.st_dev;
+        w.tasks[w.ntasks].root = i;
+        ++w.ntasks;
+    }
+
+    for (int t = 0; t < threads; t++) {
+        lists[t].walker = &w;
+    }
+    if (threads == 1) {
+        walk_worker(&lists[0]);
+    } else {
+        for (int t = 0; t < threads; t++) {
+            pthread_create(&lists[t].thread, NULL, walk_worker, &lists[t]);
+        }
+        for (int t = 0; t < threads; t++) {
+            pthread_join(lists[t].thread, NULL);
+        }
+    }
+
+    size_t total = 0;
+    for (int t = 0; t < threads; t++) {
+        total += lists[t].count;
+    }
+    walk_file *files = (walk_file *)malloc((total + 1) * sizeof(walk_file));
+    char **paths = (char **)malloc((total + 1) * sizeof(char *));
+    if (files == NULL || paths == NULL) {
+        out_of_memory();
+    }
+    total = 0;
+    for (int t = 0; t < threads; t++) {
+        if (lists[t].count > 0) {
+            memcpy(files + total, lists[t].files, lists[t].count * sizeof(walk_file));
+        }
+        total += lists[t].count;
+        free(lists[t].files);
+    }
+    qsort(files, total, sizeof(walk_file), path_cmp);
+    for (size_t i = 0; i < total; i++) {
+        paths[i] = (char *)files[i].path;
+    }
+    if (types != NULL) {
+        *types = (char *)malloc(total + 1);
+        if (*types == NULL) {
+            out_of_memory();
+        }
+        for (size_t i = 0; i < total; i++) {
+            (*types)[i] = files[i].type;
+        }
+    }
+    *count = total;
+
+    free(files);
+    free(lists);
+    free(w.tasks);
+    pthread_mutex_destroy(&w.lock);
+    pthread_cond_destroy(&w.cond);
+    return paths;
+}
@@ -0,0 +1,25 @@
+#ifndef WALK_H
+#define WALK_H
+#include <stddef.h>
+#include <stdbool.h>
+/*
+ * This header contains declearations of the directory walker used by -r,
+ * which lists the regular files under a set of paths with several threads
+ */
+
+typedef struct {
+    bool follow_symlinks; // -L, follow symbolic links met during the walk
+    bool one_file_system; // -x, stay on the file system of each starting path
+    bool all_entries; // also list the directories below the starting paths and symbolic links not followed
+    const char *skip_suffix; // leave out regular files whose names end in it, may be NULL
+} walk_options;
+
+// kinds of entries walk_paths() lists
+#define WALK_FILE 'f'
+#define WALK_DIR 'd'
+#define WALK_LINK 'l'
+
+char **walk_paths(char *const *roots, size_t nroots, int threads, const walk_options *options,
+                  size_t *count, char **types);
+
+#endif // WALK_H